@@ -4,14 +4,104 @@
  */
 
 #include "./bitarray.h"
+#include "./bitarray_numa.h"
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
 
+#include <pthread.h>
 #include <sys/types.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#ifdef BITARRAY_STATS
+#include <time.h>
+#endif
+
+/***************************************************************************/
+/* Macros                                                                  */
+/***************************************************************************/
+
+/* Size of the last-level cache that bitarray_rotate plans its passes around.
+   Build with -DBITARRAY_LLC_BYTES=<bytes> to match the target host. */
+#ifndef BITARRAY_LLC_BYTES
+#define BITARRAY_LLC_BYTES (8u << 20)
+#endif
+
+/* Largest piece bitarray_rotate stages in a scratch buffer. Half the LLC
+   leaves room for the stream of the range flowing past it. */
+#define ROTATE_BUF_BYTES (BITARRAY_LLC_BYTES / 2)
+
+/* Pieces of up to this many words are staged on the stack. */
+#define ROTATE_STACK_WORDS 64
+
+/* Runs of at least this many bits that stay together under a permutation
+   are moved as a run rather than bit group by bit group. */
+#define PLAN_RUN_MIN_BITS 64
+
+/* A pext/pdep pair emulated by shifts and masks takes about as long to
+   apply as this many shift-and-mask ops, whose time goes mostly to loading
+   and dispatching the op rather than to the shift. */
+#define PLAN_GATHER_STAGES_COST 2
+
+/* How many words ahead of each pointer a block swap prefetches. */
+#define PREFETCH_DIST 16
+
+/* Masks of the shift-and-mask stages that stand in for one pext/pdep pair:
+   six to compress the source bits and six to expand them. */
+#define GATHER_STAGES 12
+
+/* Words per copy-on-write chunk: one 4 KiB page. */
+#define COW_CHUNK_WORDS 512
+
+/* With BITARRAY_STATS defined, every public function opens with
+   STATS_BEGIN, which counts the call and the bits it touches and, when the
+   function returns, files its latency; STATS_ALLOC counts memory allocated
+   on behalf of the public call in progress. Calls made by the library to
+   itself are folded into the outermost call. Without BITARRAY_STATS both
+   compile to nothing. */
+#ifdef BITARRAY_STATS
+#define STATS_BEGIN(fn, nbits)                                          \
+    struct stats_scope stats_scope __attribute__((cleanup(stats_leave))) = \
+        stats_enter((fn), (nbits))
+#define STATS_ALLOC(bytes) stats_alloc(bytes)
+#else
+#define STATS_BEGIN(fn, nbits) ((void)0)
+#define STATS_ALLOC(bytes) ((void)0)
+#endif
+
+/* Latency histogram buckets: bucket b counts calls that took [2^(b-1), 2^b)
+   nanoseconds, and bucket 0 those that took none. */
+#define STATS_BUCKETS 64
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch((addr), 1)
+#define POPCOUNT(x) ((size_t)__builtin_popcountll(x))
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define PREFETCH(addr) ((void)(addr))
+#define POPCOUNT(x) popcount_word(x)
+#define ALWAYS_INLINE inline
+#endif
+
+/* On x86, instructions the default build may not assume are reached through
+   functions compiled for them with a target attribute and called only when
+   the CPU running the library has them. */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CPU_DISPATCH 1
+#define CPU_HAS_BMI2() __builtin_cpu_supports("bmi2")
+#define CPU_HAS_POPCNT() __builtin_cpu_supports("popcnt")
+#define CPU_HAS_SSE42() __builtin_cpu_supports("sse4.2")
+#else
+#define CPU_HAS_BMI2() false
+#define CPU_HAS_POPCNT() false
+#define CPU_HAS_SSE42() false
+#endif
+
 /***************************************************************************/
 /* Types                                                                   */
 /***************************************************************************/
@@ -21,17 +111,252 @@ struct bitarray {
     size_t bit_sz; /* The number of bits represented by this bit array */
     int_t* buf; /* The underlying memory buffer that stores the bits */
     size_t int_sz;
+    size_t cap_words; /* Words allocated for buf, at least bit_sz / int_sz + 1 */
+    size_t map_sz; /* Bytes mapped by bitarray_numa_alloc, or 0 if buf came from calloc */
+    bitarray_numa_t numa_policy; /* How a mapped buf is placed when it grows */
+    unsigned numa_threads;
+
+    /* Copy-on-write state. A clone starts with an untouched buffer and reads
+       each chunk through cow_src until it, or cow_src, is about to write the
+       chunk; then the chunk is copied into the clone's own buffer. */
+    bitarray_t* cow_src; /* The array this one still reads chunks from */
+    unsigned char* cow_have; /* Bit c set if buf holds chunk c; NULL if buf holds every chunk */
+    size_t cow_missing; /* Chunks not yet in buf */
+    bitarray_t* cow_deps; /* Clones still reading chunks from this array */
+    bitarray_t* cow_next_dep; /* The next clone of cow_src */
+    bool cow_read_only; /* Made by bitarray_snapshot */
+};
+
+/* One step of a compiled permutation plan. Bit positions and word indices
+   are relative to the start of the permuted range. */
+struct plan_op {
+    enum {
+        OP_ROTATE, /* Rotate the whole range right by src places, in place */
+        OP_RUN,    /* Move len bits from src to dst */
+        OP_SHIFT,  /* Word dst |= (word src & src_mask) shifted by delta */
+        OP_GATHER  /* Word dst |= pdep(pext(word src, src_mask), dst_mask) */
+    } kind;
+    int delta; /* Positive moves bits to higher indices */
+    size_t src;
+    size_t dst;
+    size_t len;
+    int_t src_mask;
+    int_t dst_mask;
+    size_t stages; /* OP_GATHER without BMI2: first of its masks in plan->stages */
+};
+
+struct bitarray_plan {
+    size_t bit_length; /* The number of bits the plan permutes */
+    struct plan_op* ops;
+    size_t nops;
+    size_t cap;
+    int_t* stages; /* GATHER_STAGES masks per OP_GATHER, when the CPU lacks BMI2 */
+    size_t nstages;
+    size_t stages_cap;
 };
 
+/* A bit left over for the word-to-word ops while compiling a plan. */
+struct plan_bit {
+    size_t src;
+    size_t dst;
+};
+
+#ifdef BITARRAY_STATS
+/* The public functions that keep statistics; see stats_names. */
+enum stats_fn {
+    STATS_NEW,
+    STATS_NEW_NUMA,
+    STATS_FREE,
+    STATS_CLONE,
+    STATS_SNAPSHOT,
+    STATS_GET,
+    STATS_SET,
+    STATS_RANDFILL,
+    STATS_ROTATE,
+    STATS_PLAN_NEW,
+    STATS_PLAN_ROTATE,
+    STATS_PERMUTE,
+    STATS_RESERVE,
+    STATS_INSERT_BITS,
+    STATS_ERASE_BITS,
+    STATS_HAMMING,
+    STATS_COMPARE_RANGE,
+    STATS_HASH_RANGE,
+    STATS_GET_RANGE,
+    STATS_SET_RANGE,
+    STATS_FN_COUNT
+};
+
+struct stats_counters {
+    uint64_t calls;
+    uint64_t bits; /* Bits read or written */
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t latency[STATS_BUCKETS];
+};
+
+/* Counters of one thread. Threads only ever write their own, so counting
+   takes no lock, and a reset only bumps stats_generation: each thread
+   zeroes its own counters when it next sees the change. A dump reads them
+   while their thread may be writing, so every access to a counter is a
+   relaxed atomic one. Blocks outlive their threads so totals stay
+   complete. */
+struct stats_thread {
+    struct stats_counters fn[STATS_FN_COUNT];
+    unsigned long generation; /* The stats_generation fn was last zeroed for */
+    int current; /* The public call in progress, or -1 */
+    unsigned id;
+    struct stats_thread* next;
+};
+
+/* The public call a STATS_BEGIN opened, if it was the outermost one. */
+struct stats_scope {
+    struct stats_thread* thread; /* NULL for a nested call */
+    enum stats_fn fn;
+    uint64_t start; /* stats_now() at entry */
+};
+
+static const char* const stats_names[STATS_FN_COUNT] = {
+    "bitarray_new",
+    "bitarray_new_numa",
+    "bitarray_free",
+    "bitarray_clone",
+    "bitarray_snapshot",
+    "bitarray_get",
+    "bitarray_set",
+    "bitarray_randfill",
+    "bitarray_rotate",
+    "bitarray_plan_new",
+    "bitarray_plan_rotate",
+    "bitarray_permute",
+    "bitarray_reserve",
+    "bitarray_insert_bits",
+    "bitarray_erase_bits",
+    "bitarray_hamming",
+    "bitarray_compare_range",
+    "bitarray_hash_range",
+    "bitarray_get_range",
+    "bitarray_set_range"
+};
+
+static __thread struct stats_thread* stats_self = NULL;
+static struct stats_thread* stats_threads = NULL; /* Every thread that has counted */
+static unsigned stats_nthreads = 0;
+static unsigned long stats_generation = 0; /* Bumped by every reset */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static int_t setbit[64];
 
+/* CRC32C by bytes, for CPUs without the crc32 instruction. */
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
 /***************************************************************************/
 /* Prototypes for static functions                                         */
 /***************************************************************************/
 
-static int modulo(const int x, const int y);
+static size_t modulo(const ssize_t x, const size_t y);
+#ifdef BITARRAY_STATS
+static struct stats_thread* stats_thread(void);
+static inline uint64_t stats_now(void);
+static inline bool stats_current(struct stats_thread* const t);
+static struct stats_scope stats_enter(const enum stats_fn fn, const size_t nbits);
+static void stats_leave(struct stats_scope* const scope);
+static void stats_alloc(const size_t bytes);
+static inline void stats_add(uint64_t* const counter, const uint64_t n);
+static void stats_zero(struct stats_counters* const fn);
+static void stats_copy(struct stats_counters* const dst,
+                       const struct stats_counters* const src);
+static void stats_fprint(FILE* const stream, const struct stats_counters* const fn);
+#endif
 static void build_setbit_array(const size_t int_sz);
-static inline void bitarray_reverse(bitarray_t* const bitarray, size_t i, size_t j);
+static void swap_bits(int_t* const buf, size_t i, size_t j, size_t n);
+static bool bitarray_rotate_staged(bitarray_t* const bitarray,
+                                   const size_t p,
+                                   const size_t q,
+                                   const size_t r);
+static void bitarray_rotate_in_place(bitarray_t* const bitarray,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t shift_);
+static bool plan_push(bitarray_plan_t* const plan, const struct plan_op* const op);
+static bool plan_push_gather(bitarray_plan_t* const plan,
+                             struct plan_op* const op,
+                             const bool bmi2);
+static void compress_stages(int_t mask, int_t* const stages);
+static inline int_t gather_stages(int_t x,
+                                  const int_t src_mask,
+                                  const int_t dst_mask,
+                                  const int_t* const stages);
+#if defined(HAVE_CPU_DISPATCH)
+static int_t gather_bmi2(const int_t x, const int_t src_mask, const int_t dst_mask);
+#endif
+static bool plan_compile_word(bitarray_plan_t* const plan,
+                              struct plan_bit* const bits,
+                              const size_t n);
+static bool plan_compile_pair(bitarray_plan_t* const plan,
+                              const struct plan_bit* const bits,
+                              const size_t n);
+static bitarray_t* bitarray_clone_internal(bitarray_t* const src,
+                                           const bool read_only);
+static bool bitarray_grow(bitarray_t* const bitarray, const size_t bit_sz);
+static void fill_bits(int_t* const buf, size_t bit_index, size_t n, const bool value);
+static void cow_unshare(bitarray_t* const bitarray);
+static inline size_t bitarray_words(const bitarray_t* const bitarray);
+static inline bool cow_has(const bitarray_t* const bitarray, const size_t c);
+static const int_t* cow_chunk(const bitarray_t* bitarray, const size_t c);
+static void cow_copy_chunk(bitarray_t* const bitarray, const size_t c);
+static void cow_detach(bitarray_t* const bitarray);
+static void cow_hand_over(bitarray_t* const src, bitarray_t* const heir);
+static void cow_prepare_write(bitarray_t* const bitarray,
+                              const size_t first_word,
+                              const size_t last_word);
+static inline int_t load_bits_shared(const bitarray_t* const bitarray,
+                                     const size_t bit_index,
+                                     const unsigned n);
+static inline int_t shifted_word(const int_t* const buf,
+                                 const size_t k,
+                                 const unsigned shift);
+static size_t hamming_words(const int_t* const a,
+                            const int_t* const b,
+                            const unsigned b_shift,
+                            const size_t nwords);
+static ALWAYS_INLINE size_t hamming_words_inline(const int_t* const a,
+                                                 const int_t* const b,
+                                                 const unsigned b_shift,
+                                                 const size_t nwords);
+static size_t compare_words(const int_t* const a,
+                            const int_t* const b,
+                            const unsigned b_shift,
+                            const size_t nwords);
+static uint64_t hash_mix(uint64_t h);
+#if !defined(__GNUC__)
+static inline size_t popcount_word(int_t x);
+#endif
+static void hash_words(const int_t* const words,
+                       const unsigned shift,
+                       const size_t nwords,
+                       uint32_t* const crc,
+                       const bool sse42);
+static ALWAYS_INLINE void hash_words_inline(const int_t* const words,
+                                            const unsigned shift,
+                                            const size_t nwords,
+                                            uint32_t* const crc,
+                                            const bool sse42);
+static ALWAYS_INLINE uint32_t crc32c_word(const bool sse42, uint32_t crc, int_t x);
+static void build_crc32c_table(void);
+#if defined(HAVE_CPU_DISPATCH)
+static size_t hamming_words_popcnt(const int_t* const a,
+                                   const int_t* const b,
+                                   const unsigned b_shift,
+                                   const size_t nwords);
+static void hash_words_sse42(const int_t* const words,
+                             const unsigned shift,
+                             const size_t nwords,
+                             uint32_t* const crc);
+static inline uint32_t crc32c_word_sse42(const uint32_t crc, const int_t x);
+#endif
 
 /***************************************************************************/
 /* Functions                                                               */
@@ -39,6 +364,7 @@ static inline void bitarray_reverse(bitarray_t* const bitarray, size_t i, size_t
 
 bitarray_t* bitarray_new(const size_t bit_sz)
 {
+    STATS_BEGIN(STATS_NEW, bit_sz);
     size_t int_sz = sizeof(int_t) * 8;
     build_setbit_array(int_sz);
 
@@ -46,6 +372,7 @@ bitarray_t* bitarray_new(const size_t bit_sz)
     int_t* const buf = calloc((bit_sz / int_sz) + 1, sizeof(int_sz));
     if (buf == NULL)
         return NULL;
+    STATS_ALLOC(((bit_sz / int_sz) + 1) * sizeof(int_sz));
 
     /* Allocate space for the struct. */
     bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
@@ -54,18 +381,84 @@ bitarray_t* bitarray_new(const size_t bit_sz)
         free(buf);
         return NULL;
     }
+    STATS_ALLOC(sizeof(struct bitarray));
+
+    bitarray->buf = buf;
+    bitarray->bit_sz = bit_sz;
+    bitarray->int_sz = int_sz;
+    bitarray->cap_words = (bit_sz / int_sz) + 1;
+    bitarray->map_sz = 0;
+    bitarray->numa_policy = BITARRAY_NUMA_DEFAULT;
+    bitarray->numa_threads = 0;
+    bitarray->cow_src = NULL;
+    bitarray->cow_have = NULL;
+    bitarray->cow_missing = 0;
+    bitarray->cow_deps = NULL;
+    bitarray->cow_next_dep = NULL;
+    bitarray->cow_read_only = false;
+    return bitarray;
+}
+
+bitarray_t* bitarray_new_numa(const size_t bit_sz,
+                              const bitarray_numa_t policy,
+                              const unsigned nthreads)
+{
+    STATS_BEGIN(STATS_NEW_NUMA, bit_sz);
+    if (policy == BITARRAY_NUMA_DEFAULT)
+        return bitarray_new(bit_sz);
+
+    size_t int_sz = sizeof(int_t) * 8;
+    build_setbit_array(int_sz);
+
+    /* Same ceil(bit_sz / int_sz) + 1 words as bitarray_new, but mapped
+       and placed rather than zeroed by calloc on this thread. */
+    const size_t map_sz = ((bit_sz / int_sz) + 1) * sizeof(int_t);
+    int_t* const buf = bitarray_numa_alloc(map_sz, policy, nthreads);
+    if (buf == NULL)
+        return NULL;
+    STATS_ALLOC(map_sz);
+
+    bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
+    if (bitarray == NULL)
+    {
+        bitarray_numa_free(buf, map_sz);
+        return NULL;
+    }
+    STATS_ALLOC(sizeof(struct bitarray));
 
     bitarray->buf = buf;
     bitarray->bit_sz = bit_sz;
     bitarray->int_sz = int_sz;
+    bitarray->cap_words = (bit_sz / int_sz) + 1;
+    bitarray->map_sz = map_sz;
+    bitarray->numa_policy = policy;
+    bitarray->numa_threads = nthreads;
+    bitarray->cow_src = NULL;
+    bitarray->cow_have = NULL;
+    bitarray->cow_missing = 0;
+    bitarray->cow_deps = NULL;
+    bitarray->cow_next_dep = NULL;
+    bitarray->cow_read_only = false;
     return bitarray;
 }
 
 void bitarray_free(bitarray_t* const bitarray)
 {
+    STATS_BEGIN(STATS_FREE, 0);
     if (bitarray == NULL)
         return;
-    free(bitarray->buf);
+
+    /* Clones still reading through this array inherit its buffer rather
+       than copying every chunk they lack out of it. */
+    if (bitarray->cow_deps != NULL)
+        cow_hand_over(bitarray, bitarray->cow_deps);
+    if (bitarray->cow_src != NULL)
+        cow_detach(bitarray);
+
+    if (bitarray->map_sz != 0)
+        bitarray_numa_free(bitarray->buf, bitarray->map_sz);
+    else
+        free(bitarray->buf);
     bitarray->buf = NULL;
     free(bitarray);
 }
@@ -75,10 +468,26 @@ size_t bitarray_get_bit_sz(const bitarray_t* const bitarray)
     return bitarray->bit_sz;
 }
 
+bitarray_t* bitarray_clone(bitarray_t* const bitarray)
+{
+    STATS_BEGIN(STATS_CLONE, 0);
+    return bitarray_clone_internal(bitarray, false);
+}
+
+bitarray_t* bitarray_snapshot(bitarray_t* const bitarray)
+{
+    STATS_BEGIN(STATS_SNAPSHOT, 0);
+    return bitarray_clone_internal(bitarray, true);
+}
+
 inline bool bitarray_get(const bitarray_t* const bitarray, const size_t bit_index)
 {
+    STATS_BEGIN(STATS_GET, 1);
     size_t int_sz = bitarray->int_sz;
-    return (bitarray->buf[bit_index / int_sz] & setbit[bit_index % int_sz]) ?
+    const size_t w = bit_index / int_sz;
+    const int_t word = bitarray->cow_have == NULL ? bitarray->buf[w] :
+        cow_chunk(bitarray, w / COW_CHUNK_WORDS)[w % COW_CHUNK_WORDS];
+    return (word & setbit[bit_index % int_sz]) ?
          true : false;
 }    
 
@@ -86,7 +495,10 @@ inline void bitarray_set(bitarray_t* const bitarray,
                          const size_t bit_index,
                          const bool value)
 {
+    STATS_BEGIN(STATS_SET, 1);
     size_t int_sz = bitarray->int_sz;
+    if (bitarray->cow_src != NULL || bitarray->cow_deps != NULL)
+        cow_prepare_write(bitarray, bit_index / int_sz, bit_index / int_sz);
     bitarray->buf[bit_index / int_sz] =
         (bitarray->buf[bit_index / int_sz] & ~setbit[bit_index % int_sz]) |
         (value ? setbit[bit_index % int_sz] : 0);
@@ -94,21 +506,169 @@ inline void bitarray_set(bitarray_t* const bitarray,
 
 void bitarray_randfill(bitarray_t* const bitarray)
 {
+    STATS_BEGIN(STATS_RANDFILL, bitarray->bit_sz);
+    cow_prepare_write(bitarray, 0, bitarray_words(bitarray) - 1);
     int64_t* ptr = (int64_t*)bitarray->buf;
     for (int64_t i = 0; i < bitarray->bit_sz / 64 + 1; ++i)
         ptr[i] = rand();
 }
 
-static inline void bitarray_reverse(bitarray_t* const bitarray, size_t i, size_t j)
+/* Mask selecting the n (1 <= n <= 64) most significant bits of a word. */
+static inline int_t top_mask(const unsigned n)
+{
+    return ~(int_t)0 << (64 - n);
+}
+
+/* Load n (1 <= n <= 64) bits starting at bit_index. Bit order follows
+   setbit[], so the first bit lands in the most significant position. */
+static inline int_t load_bits(const int_t* const buf,
+                              const size_t bit_index,
+                              const unsigned n)
+{
+    const size_t w = bit_index / 64;
+    const unsigned o = bit_index % 64;
+    int_t v = buf[w] << o;
+    if (o + n > 64)
+        v |= buf[w + 1] >> (64 - o);
+    return v & top_mask(n);
+}
+
+/* Store the n (1 <= n <= 64) most significant bits of bits at bit_index,
+   leaving the neighbouring bits untouched. */
+static inline void store_bits(int_t* const buf,
+                              const size_t bit_index,
+                              const unsigned n,
+                              const int_t bits)
+{
+    const size_t w = bit_index / 64;
+    const unsigned o = bit_index % 64;
+    const int_t m = top_mask(n);
+    buf[w] = (buf[w] & ~(m >> o)) | ((bits & m) >> o);
+    if (o + n > 64)
+        buf[w + 1] = (buf[w + 1] & ~(m << (64 - o))) | ((bits & m) << (64 - o));
+}
+
+/* Copy n bits from bit src_index of src to bit dst_index of dst. Like
+   memmove, the two ranges may overlap. Whole destination words are written
+   wherever possible. */
+static void move_bits(int_t* const dst, size_t dst_index,
+                      const int_t* const src, size_t src_index,
+                      size_t n)
+{
+    unsigned m;
+    if (dst != src || dst_index <= src_index)
+    {
+        /* Front to back: bring the destination to a word boundary first. */
+        if (n > 0 && dst_index % 64 != 0)
+        {
+            m = 64 - dst_index % 64;
+            if (m > n) m = n;
+            store_bits(dst, dst_index, m, load_bits(src, src_index, m));
+            dst_index += m; src_index += m; n -= m;
+        }
+        for (; n >= 64; n -= 64, dst_index += 64, src_index += 64)
+            dst[dst_index / 64] = load_bits(src, src_index, 64);
+        if (n > 0)
+            store_bits(dst, dst_index, n, load_bits(src, src_index, n));
+    }
+    else
+    {
+        /* Back to front, so the tail of the source is read before the head
+           of the destination overwrites it. */
+        dst_index += n; src_index += n;
+        if (n > 0 && dst_index % 64 != 0)
+        {
+            m = dst_index % 64;
+            if (m > n) m = n;
+            dst_index -= m; src_index -= m; n -= m;
+            store_bits(dst, dst_index, m, load_bits(src, src_index, m));
+        }
+        for (; n >= 64; n -= 64)
+        {
+            dst_index -= 64; src_index -= 64;
+            dst[dst_index / 64] = load_bits(src, src_index, 64);
+        }
+        if (n > 0)
+        {
+            dst_index -= n; src_index -= n;
+            store_bits(dst, dst_index, n, load_bits(src, src_index, n));
+        }
+    }
+}
+
+/* Swap the n bits at bit i with the n bits at bit j, two ranges that do
+   not overlap, a word at a time. Long swaps prefetch ahead of both. */
+static void swap_bits(int_t* const buf, size_t i, size_t j, size_t n)
+{
+    int_t bi;
+    if (n > 0 && i % 64 != 0)
+    {
+        unsigned m = 64 - i % 64;
+        if (m > n) m = n;
+        bi = load_bits(buf, i, m);
+        store_bits(buf, i, m, load_bits(buf, j, m));
+        store_bits(buf, j, m, bi);
+        i += m; j += m; n -= m;
+    }
+    for (; n >= 64; n -= 64, i += 64, j += 64)
+    {
+        if (n >= 64 * PREFETCH_DIST)
+        {
+            PREFETCH(&buf[i / 64 + PREFETCH_DIST]);
+            PREFETCH(&buf[j / 64 + PREFETCH_DIST]);
+        }
+        bi = buf[i / 64];
+        buf[i / 64] = load_bits(buf, j, 64);
+        store_bits(buf, j, 64, bi);
+    }
+    if (n > 0)
+    {
+        bi = load_bits(buf, i, n);
+        store_bits(buf, i, n, load_bits(buf, j, n));
+        store_bits(buf, j, n, bi);
+    }
+}
+
+/* Rotate [p, r] so that [q, r] moves to the front, in a single pass: the
+   smaller of the two pieces is staged in a scratch buffer while the larger
+   one is shifted into place. Returns false if no scratch buffer could be
+   allocated. */
+static bool bitarray_rotate_staged(bitarray_t* const bitarray,
+                                   const size_t p,
+                                   const size_t q,
+                                   const size_t r)
 {
-    if (!bitarray) return;
-    while (i < j)
+    int_t stack_tmp[ROTATE_STACK_WORDS];
+    int_t* const buf = bitarray->buf;
+    const size_t a_len = q - p;
+    const size_t b_len = r - q + 1;
+    const size_t tmp_len = a_len < b_len ? a_len : b_len;
+
+    int_t* tmp = stack_tmp;
+    if (tmp_len > ROTATE_STACK_WORDS * 64)
+    {
+        tmp = malloc((tmp_len / 64 + 1) * sizeof(int_t));
+        if (tmp == NULL)
+            return false;
+        STATS_ALLOC((tmp_len / 64 + 1) * sizeof(int_t));
+    }
+
+    if (b_len <= a_len)
     {
-        bool bit_i = bitarray_get(bitarray, i);
-        bitarray_set(bitarray, i, bitarray_get(bitarray, j));
-        bitarray_set(bitarray, j, bit_i);
-        ++i; --j;
+        move_bits(tmp, 0, buf, q, b_len);
+        move_bits(buf, p + b_len, buf, p, a_len);
+        move_bits(buf, p, tmp, 0, b_len);
     }
+    else
+    {
+        move_bits(tmp, 0, buf, p, a_len);
+        move_bits(buf, p, buf, q, b_len);
+        move_bits(buf, p + b_len, tmp, 0, a_len);
+    }
+
+    if (tmp != stack_tmp)
+        free(tmp);
+    return true;
 }
 
 void bitarray_rotate(bitarray_t* const bitarray,
@@ -116,95 +676,1326 @@ void bitarray_rotate(bitarray_t* const bitarray,
                      const size_t bit_length,
                      const ssize_t shift)
 {
+    STATS_BEGIN(STATS_ROTATE, bit_length);
     assert(bit_offset + bit_length <= bitarray->bit_sz);
     if (bit_length == 0)
         return;
 
-    /* bit_length >= 0, therefore, 0 <= modulo(shift, bit_length) < bit_length */
-    size_t shift_ = (size_t)modulo(shift, bit_length);
-    
-    size_t p, q, r;
-    p = bit_offset;
-    r = p + bit_length - 1;
-    q = r - shift_ + 1;
+    /* A one-op plan on the stack; bit_length >= 0, therefore,
+       0 <= modulo(shift, bit_length) < bit_length */
+    struct plan_op op = {.kind = OP_ROTATE,
+                         .len = bit_length,
+                         .src = modulo(shift, bit_length)};
+    const struct bitarray_plan plan = {.bit_length = bit_length, .ops = &op, .nops = 1, .cap = 1};
+    bitarray_permute(bitarray, bit_offset, &plan);
+}
 
-    int i, j, di, mi, dj, mj;
-    int_t* buf = bitarray->buf;
-    size_t int_sz = bitarray->int_sz;
+bitarray_plan_t* bitarray_plan_new(const size_t* const perm, const size_t bit_length)
+{
+    STATS_BEGIN(STATS_PLAN_NEW, bit_length);
+    /* Reject anything that is not a permutation of [0, bit_length). */
+    unsigned char* const seen = calloc(bit_length / 8 + 1, 1);
+    if (seen == NULL)
+        return NULL;
+    STATS_ALLOC(bit_length / 8 + 1);
+    for (size_t i = 0; i < bit_length; ++i)
+    {
+        if (perm[i] >= bit_length || (seen[perm[i] / 8] >> (perm[i] % 8)) & 1)
+        {
+            free(seen);
+            return NULL;
+        }
+        seen[perm[i] / 8] |= 1 << (perm[i] % 8);
+    }
+    free(seen);
+
+    /* A rotation runs in place; see bitarray_rotate. */
+    bool is_rotation = true;
+    for (size_t i = 0; i < bit_length && is_rotation; ++i)
+        is_rotation = perm[i] == (i + perm[0]) % bit_length;
+    if (is_rotation)
+        return bitarray_plan_rotate(bit_length, bit_length == 0 ? 0 : (ssize_t)perm[0]);
+
+    bitarray_plan_t* const plan = calloc(1, sizeof(struct bitarray_plan));
+    if (plan == NULL)
+        return NULL;
+    STATS_ALLOC(sizeof(struct bitarray_plan));
+    plan->bit_length = bit_length;
 
-    /* reverse bits in range [p, q - 1] */
-    i = p; j = q - 1;
-       while (i < j)
+    /* Runs of consecutive bits that stay consecutive become word moves; the
+       bits of shorter runs are collected one source word at a time for the
+       word-to-word ops below. */
+    struct plan_bit bits[64];
+    size_t nbits = 0;
+    bool ok = true;
+    for (size_t i = 0, j; i < bit_length && ok; i = j + 1)
     {
-        di = i / int_sz; mi = i % int_sz;
-        dj = j / int_sz; mj = j % int_sz;
+        for (j = i; j + 1 < bit_length && perm[j + 1] == perm[j] + 1; ++j)
+            ;
+        if (j - i + 1 >= PLAN_RUN_MIN_BITS)
+        {
+            struct plan_op op = {.kind = OP_RUN, .src = i, .dst = perm[i], .len = j - i + 1};
+            ok = plan_push(plan, &op);
+            continue;
+        }
+        for (size_t k = i; k <= j && ok; ++k)
+        {
+            if (nbits > 0 && bits[0].src / 64 != k / 64)
+            {
+                ok = plan_compile_word(plan, bits, nbits);
+                nbits = 0;
+            }
+            bits[nbits].src = k;
+            bits[nbits].dst = perm[k];
+            nbits++;
+        }
+    }
+    if (ok && nbits > 0)
+        ok = plan_compile_word(plan, bits, nbits);
 
-        int_t bi = buf[di] & setbit[mi];
-        int_t bj = buf[dj] & setbit[mj];
-        if (bi != 0 && bj == 0)
+    if (!ok)
+    {
+        bitarray_plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+bitarray_plan_t* bitarray_plan_rotate(const size_t bit_length, const ssize_t shift)
+{
+    STATS_BEGIN(STATS_PLAN_ROTATE, 0);
+    bitarray_plan_t* const plan = calloc(1, sizeof(struct bitarray_plan));
+    if (plan == NULL)
+        return NULL;
+    STATS_ALLOC(sizeof(struct bitarray_plan));
+    plan->bit_length = bit_length;
+    struct plan_op op = {.kind = OP_ROTATE,
+                         .len = bit_length,
+                         .src = bit_length == 0 ? 0 : modulo(shift, bit_length)};
+    if (!plan_push(plan, &op))
+    {
+        bitarray_plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+void bitarray_plan_free(bitarray_plan_t* const plan)
+{
+    if (plan == NULL)
+        return;
+    free(plan->ops);
+    free(plan->stages);
+    free(plan);
+}
+
+size_t bitarray_plan_length(const bitarray_plan_t* const plan)
+{
+    return plan->bit_length;
+}
+
+bool bitarray_permute(bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const bitarray_plan_t* const plan)
+{
+    STATS_BEGIN(STATS_PERMUTE, plan->bit_length);
+    const size_t bit_length = plan->bit_length;
+    assert(bit_offset + bit_length <= bitarray->bit_sz);
+    if (bit_length == 0)
+        return true;
+
+    if (plan->nops == 1 && plan->ops[0].kind == OP_ROTATE)
+    {
+        if (plan->ops[0].src != 0)
         {
-            buf[di] &= ~setbit[mi];
-            buf[dj] |=  setbit[mj];
+            cow_prepare_write(bitarray, bit_offset / 64, (bit_offset + bit_length - 1) / 64);
+            bitarray_rotate_in_place(bitarray, bit_offset, bit_length, plan->ops[0].src);
         }
-        else if (bi == 0 && bj != 0)
+        return true;
+    }
+
+    /* Everything else reads from a copy of the range, aligned so that
+       source word k holds bits [64k, 64k + 64) of it, and builds the result
+       in a zeroed copy aligned the same way. */
+    const size_t words = bit_length / 64 + 1;
+    int_t stack_tmp[2 * ROTATE_STACK_WORDS];
+    int_t* tmp = stack_tmp;
+    if (words > ROTATE_STACK_WORDS)
+    {
+        tmp = malloc(2 * words * sizeof(int_t));
+        if (tmp == NULL)
+            return false;
+        STATS_ALLOC(2 * words * sizeof(int_t));
+    }
+    int_t* const in = tmp;
+    int_t* const out = tmp + words;
+    memset(out, 0, words * sizeof(int_t));
+
+    cow_prepare_write(bitarray, bit_offset / 64, (bit_offset + bit_length - 1) / 64);
+    move_bits(in, 0, bitarray->buf, bit_offset, bit_length);
+
+    const bool bmi2 = CPU_HAS_BMI2();
+    for (size_t k = 0; k < plan->nops; ++k)
+    {
+        const struct plan_op* const op = &plan->ops[k];
+        switch (op->kind)
         {
-            buf[di] |=  setbit[mi];
-            buf[dj] &= ~setbit[mj];
+        case OP_RUN:
+            move_bits(out, op->dst, in, op->src, op->len);
+            break;
+        case OP_SHIFT:
+        {
+            const int_t x = in[op->src] & op->src_mask;
+            out[op->dst] |= op->delta >= 0 ? x >> op->delta : x << -op->delta;
+            break;
+        }
+        case OP_GATHER:
+#if defined(HAVE_CPU_DISPATCH)
+            if (bmi2)
+            {
+                out[op->dst] |= gather_bmi2(in[op->src], op->src_mask, op->dst_mask);
+                break;
+            }
+#endif
+            out[op->dst] |= gather_stages(in[op->src], op->src_mask, op->dst_mask,
+                                          &plan->stages[op->stages]);
+            break;
+        default:
+            assert(false);
         }
-        ++i; --j;
     }
-    
-    /* reverse bits in range [q, r] */
-    i = q; j = r;
-    while (i < j)
+
+    move_bits(bitarray->buf, bit_offset, out, 0, bit_length);
+    if (tmp != stack_tmp)
+        free(tmp);
+    return true;
+}
+
+bool bitarray_reserve(bitarray_t* const bitarray, const size_t bit_capacity)
+{
+    STATS_BEGIN(STATS_RESERVE, 0);
+    return bitarray_grow(bitarray, bit_capacity);
+}
+
+bool bitarray_insert_bits(bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const size_t n,
+                          const bool value)
+{
+    STATS_BEGIN(STATS_INSERT_BITS, bitarray->bit_sz - bit_index + n);
+    const size_t bit_sz = bitarray->bit_sz;
+    assert(bit_index <= bit_sz);
+    if (n == 0)
+        return true;
+    if (!bitarray_grow(bitarray, bit_sz + n))
+        return false;
+
+    cow_unshare(bitarray);
+    move_bits(bitarray->buf, bit_index + n, bitarray->buf, bit_index, bit_sz - bit_index);
+    fill_bits(bitarray->buf, bit_index, n, value);
+    bitarray->bit_sz = bit_sz + n;
+    return true;
+}
+
+void bitarray_erase_bits(bitarray_t* const bitarray,
+                         const size_t bit_index,
+                         const size_t n)
+{
+    STATS_BEGIN(STATS_ERASE_BITS, bitarray->bit_sz - bit_index);
+    const size_t bit_sz = bitarray->bit_sz;
+    assert(bit_index + n <= bit_sz);
+    if (n == 0)
+        return;
+
+    cow_unshare(bitarray);
+    move_bits(bitarray->buf, bit_index, bitarray->buf, bit_index + n, bit_sz - bit_index - n);
+    bitarray->bit_sz = bit_sz - n;
+}
+
+size_t bitarray_hamming(const bitarray_t* const a,
+                        const size_t a_offset,
+                        const bitarray_t* const b,
+                        const size_t b_offset,
+                        const size_t bit_length)
+{
+    STATS_BEGIN(STATS_HAMMING, 2 * bit_length);
+    assert(a_offset + bit_length <= a->bit_sz);
+    assert(b_offset + bit_length <= b->bit_sz);
+    size_t count = 0;
+    size_t done = 0;
+
+    /* Bring the range of a to a word boundary, then read whole words of a
+       against words of b shifted into line with them. */
+    if (a->cow_have == NULL && b->cow_have == NULL)
     {
-        di = i / int_sz; mi = i % int_sz;
-        dj = j / int_sz; mj = j % int_sz;
+        done = (64 - a_offset % 64) % 64;
+        if (done > bit_length)
+            done = bit_length;
+        if (done > 0)
+            count += POPCOUNT(load_bits(a->buf, a_offset, done) ^
+                              load_bits(b->buf, b_offset, done));
+        const size_t nwords = (bit_length - done) / 64;
+        count += hamming_words(a->buf + (a_offset + done) / 64,
+                               b->buf + (b_offset + done) / 64,
+                               (b_offset + done) % 64,
+                               nwords);
+        done += nwords * 64;
+    }
+
+    /* The last partial word, or every word of an array that still shares
+       chunks with a clone. */
+    for (; done < bit_length; done += 64)
+    {
+        const unsigned n = bit_length - done < 64 ? bit_length - done : 64;
+        count += POPCOUNT(load_bits_shared(a, a_offset + done, n) ^
+                          load_bits_shared(b, b_offset + done, n));
+    }
+    return count;
+}
+
+int bitarray_compare_range(const bitarray_t* const a,
+                           const size_t a_offset,
+                           const bitarray_t* const b,
+                           const size_t b_offset,
+                           const size_t bit_length)
+{
+    STATS_BEGIN(STATS_COMPARE_RANGE, 2 * bit_length);
+    assert(a_offset + bit_length <= a->bit_sz);
+    assert(b_offset + bit_length <= b->bit_sz);
+    int_t x = 0;
+    int_t y = 0;
+    size_t done = 0;
 
-        int_t bi = buf[di] & setbit[mi];
-        int_t bj = buf[dj] & setbit[mj];
-        if (bi != 0 && bj == 0)
+    /* Words hold their first bit in the most significant position, so the
+       first differing word decides the order as an unsigned integer. */
+    if (a->cow_have == NULL && b->cow_have == NULL)
+    {
+        done = (64 - a_offset % 64) % 64;
+        if (done > bit_length)
+            done = bit_length;
+        if (done > 0)
         {
-            buf[di] &= ~setbit[mi];
-            buf[dj] |=  setbit[mj];
+            x = load_bits(a->buf, a_offset, done);
+            y = load_bits(b->buf, b_offset, done);
+            if (x != y)
+                return x < y ? -1 : 1;
         }
-        else if (bi == 0 && bj != 0)
+        const int_t* const a_words = a->buf + (a_offset + done) / 64;
+        const int_t* const b_words = b->buf + (b_offset + done) / 64;
+        const unsigned b_shift = (b_offset + done) % 64;
+        const size_t nwords = (bit_length - done) / 64;
+        const size_t k = compare_words(a_words, b_words, b_shift, nwords);
+        if (k < nwords)
         {
-            buf[di] |=  setbit[mi];
-            buf[dj] &= ~setbit[mj];
+            x = a_words[k];
+            y = shifted_word(b_words, k, b_shift);
+            return x < y ? -1 : 1;
         }
-        ++i; --j;
+        done += nwords * 64;
+    }
+
+    for (; done < bit_length; done += 64)
+    {
+        const unsigned n = bit_length - done < 64 ? bit_length - done : 64;
+        x = load_bits_shared(a, a_offset + done, n);
+        y = load_bits_shared(b, b_offset + done, n);
+        if (x != y)
+            return x < y ? -1 : 1;
+    }
+    return 0;
+}
+
+uint64_t bitarray_hash_range(const bitarray_t* const bitarray,
+                             const size_t bit_offset,
+                             const size_t bit_length)
+{
+    STATS_BEGIN(STATS_HASH_RANGE, bit_length);
+    assert(bit_offset + bit_length <= bitarray->bit_sz);
+    const bool sse42 = CPU_HAS_SSE42();
+    if (!sse42)
+        pthread_once(&crc32c_table_once, build_crc32c_table);
+
+    /* The range is cut into words counted from its first bit, wherever that
+       falls, and the words take turns among three CRC32C lanes, enough to
+       hide the latency of the crc32 instruction. */
+    uint32_t crc[3] = {0xFFFFFFFFu, 0x9E3779B9u, 0x7F4A7C15u};
+    const size_t nwords = bit_length / 64;
+    size_t k = 0;
+    if (bitarray->cow_have == NULL)
+    {
+        k = nwords - nwords % 3;
+        hash_words(bitarray->buf + bit_offset / 64, bit_offset % 64, k, crc, sse42);
+    }
+    for (; k < nwords; ++k)
+        crc[k % 3] = crc32c_word(sse42, crc[k % 3],
+                                 load_bits_shared(bitarray, bit_offset + k * 64, 64));
+    if (bit_length % 64 != 0)
+        crc[k % 3] = crc32c_word(sse42, crc[k % 3],
+                                 load_bits_shared(bitarray, bit_offset + k * 64,
+                                                  bit_length % 64));
+
+    /* The length tells apart ranges that differ only in trailing zeros. */
+    return hash_mix((((uint64_t)crc[1] << 32) | crc[0]) ^
+                    hash_mix(((uint64_t)crc[2] << 32) ^ bit_length));
+}
+
+void bitarray_get_range(const bitarray_t* const bitarray,
+                        const size_t bit_index,
+                        const size_t bit_length,
+                        int_t* const words)
+{
+    STATS_BEGIN(STATS_GET_RANGE, bit_length);
+    assert(bit_index + bit_length <= bitarray->bit_sz);
+    if (bit_length == 0)
+        return;
+    if (bitarray->cow_have == NULL)
+    {
+        words[(bit_length - 1) / 64] = 0;
+        move_bits(words, 0, bitarray->buf, bit_index, bit_length);
+        return;
     }
-    
-    /* reverse bits in range [p, r] */
-    i = p; j = r;
-    while (i < j)
+    for (size_t k = 0; k * 64 < bit_length; ++k)
     {
-        di = i / int_sz; mi = i % int_sz;
-        dj = j / int_sz; mj = j % int_sz;
+        const unsigned n = bit_length - k * 64 < 64 ? bit_length - k * 64 : 64;
+        words[k] = load_bits_shared(bitarray, bit_index + k * 64, n);
+    }
+}
+
+void bitarray_set_range(bitarray_t* const bitarray,
+                        const size_t bit_index,
+                        const size_t bit_length,
+                        const int_t* const words)
+{
+    STATS_BEGIN(STATS_SET_RANGE, bit_length);
+    assert(bit_index + bit_length <= bitarray->bit_sz);
+    if (bit_length == 0)
+        return;
+    if (bitarray->cow_src != NULL || bitarray->cow_deps != NULL)
+        cow_prepare_write(bitarray, bit_index / 64, (bit_index + bit_length - 1) / 64);
+    move_bits(bitarray->buf, bit_index, words, 0, bit_length);
+}
 
-        int_t bi = buf[di] & setbit[mi];
-        int_t bj = buf[dj] & setbit[mj];
-        if (bi != 0 && bj == 0)
+const int_t* bitarray_view_words(const bitarray_t* const bitarray,
+                                 const size_t first_word,
+                                 const size_t last_word)
+{
+    assert(first_word <= last_word && last_word < bitarray->bit_sz / 64);
+    if (bitarray->cow_have != NULL)
+    {
+        for (size_t c = first_word / COW_CHUNK_WORDS; c <= last_word / COW_CHUNK_WORDS; ++c)
         {
-            buf[di] &= ~setbit[mi];
-            buf[dj] |=  setbit[mj];
+            if (!cow_has(bitarray, c))
+                return NULL;
         }
-        else if (bi == 0 && bj != 0)
+    }
+    return bitarray->buf + first_word;
+}
+
+int_t* bitarray_edit_words(bitarray_t* const bitarray,
+                           const size_t first_word,
+                           const size_t last_word)
+{
+    assert(first_word <= last_word && last_word < bitarray->bit_sz / 64);
+    if (bitarray->cow_src != NULL || bitarray->cow_deps != NULL)
+        cow_prepare_write(bitarray, first_word, last_word);
+    return bitarray->buf + first_word;
+}
+
+size_t bitarray_rotate_dram_bytes(const size_t bit_length, const ssize_t shift)
+{
+    if (bit_length == 0)
+        return 0;
+    const size_t shift_ = modulo(shift, bit_length);
+    if (shift_ == 0)
+        return 0;
+
+    /* Follow the schedule of bitarray_rotate_in_place: a range that fits in
+       the LLC, or a staged pass, is read and written back once; a swap of
+       two blocks of n bits reads and writes 2n bits. */
+    if (bit_length / 8 <= BITARRAY_LLC_BYTES)
+        return 2 * (bit_length / 8);
+    size_t a = bit_length - shift_;
+    size_t b = shift_;
+    size_t bytes = 0;
+    while (a > 0 && b > 0)
+    {
+        const size_t small = a < b ? a : b;
+        if (small / 8 <= ROTATE_BUF_BYTES)
+            return bytes + 2 * ((a + b) / 8);
+        bytes += 4 * (small / 8);
+        if (a <= b)
+            b -= a;
+        else
+            a -= b;
+    }
+    return bytes;
+}
+
+void bitarray_stats_dump(FILE* const stream)
+{
+#ifdef BITARRAY_STATS
+    struct stats_counters total[STATS_FN_COUNT];
+    struct stats_counters fn[STATS_FN_COUNT];
+    memset(total, 0, sizeof(total));
+
+    pthread_mutex_lock(&stats_lock);
+    fprintf(stream, "{\"enabled\": true, \"threads\": [");
+    for (struct stats_thread* t = stats_threads; t != NULL; t = t->next)
+    {
+        fprintf(stream, "%s\n  {\"thread\": %u", t == stats_threads ? "" : ",", t->id);
+        /* Counters a thread has not zeroed since the last reset count as
+           zero. */
+        if (!stats_current(t))
         {
-            buf[di] |=  setbit[mi];
-            buf[dj] &= ~setbit[mj];
+            fprintf(stream, ", \"functions\": {}}");
+            continue;
         }
-        ++i; --j;
+        stats_copy(fn, t->fn);
+        stats_fprint(stream, fn);
+        fprintf(stream, "}");
+        for (int f = 0; f < STATS_FN_COUNT; ++f)
+        {
+            total[f].calls += fn[f].calls;
+            total[f].bits += fn[f].bits;
+            total[f].allocs += fn[f].allocs;
+            total[f].alloc_bytes += fn[f].alloc_bytes;
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+                total[f].latency[b] += fn[f].latency[b];
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    fprintf(stream, "],\n \"total\": {\"threads\": %u", stats_nthreads);
+    stats_fprint(stream, total);
+    fprintf(stream, "}}\n");
+#else
+    fprintf(stream, "{\"enabled\": false}\n");
+#endif
+}
+
+void bitarray_stats_reset(void)
+{
+#ifdef BITARRAY_STATS
+    /* Other threads may be counting, so their counters are left to them;
+       see struct stats_thread. */
+    __atomic_add_fetch(&stats_generation, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+static bitarray_t* bitarray_clone_internal(bitarray_t* const src,
+                                           const bool read_only)
+{
+    bitarray_t* const bitarray = bitarray_new(src->bit_sz);
+    if (bitarray == NULL)
+        return NULL;
+
+    /* The buffer from bitarray_new is left untouched until chunks are copied
+       into it, so for large arrays only those chunks take up memory. */
+    const size_t chunks = (bitarray_words(bitarray) + COW_CHUNK_WORDS - 1) / COW_CHUNK_WORDS;
+    bitarray->cow_have = calloc((chunks + 7) / 8, 1);
+    if (bitarray->cow_have == NULL)
+    {
+        bitarray_free(bitarray);
+        return NULL;
+    }
+    STATS_ALLOC((chunks + 7) / 8);
+    bitarray->cow_missing = chunks;
+    bitarray->cow_src = src;
+    bitarray->cow_next_dep = src->cow_deps;
+    src->cow_deps = bitarray;
+    bitarray->cow_read_only = read_only;
+    return bitarray;
+}
+
+/* Make room in the buffer for bit_sz bits, at least doubling the capacity
+   whenever it has to grow so that a run of insertions costs amortized
+   constant time per bit. A mapped buffer is re-mapped under its NUMA
+   policy; a heap buffer is extended with zeroes, as calloc would. */
+static bool bitarray_grow(bitarray_t* const bitarray, const size_t bit_sz)
+{
+    const size_t need = bit_sz / 64 + 1;
+    const size_t old_cap = bitarray->cap_words;
+    if (need <= old_cap)
+        return true;
+    const size_t cap = 2 * old_cap > need ? 2 * old_cap : need;
+
+    int_t* buf;
+    if (bitarray->map_sz != 0)
+    {
+        buf = bitarray_numa_alloc(cap * sizeof(int_t), bitarray->numa_policy, bitarray->numa_threads);
+        if (buf == NULL)
+            return false;
+        memcpy(buf, bitarray->buf, old_cap * sizeof(int_t));
+        bitarray_numa_free(bitarray->buf, bitarray->map_sz);
+        bitarray->map_sz = cap * sizeof(int_t);
+    }
+    else
+    {
+        buf = realloc(bitarray->buf, cap * sizeof(int_t));
+        if (buf == NULL)
+            return false;
+        memset(buf + old_cap, 0, (cap - old_cap) * sizeof(int_t));
+    }
+    STATS_ALLOC(cap * sizeof(int_t));
+    bitarray->buf = buf;
+    bitarray->cap_words = cap;
+    return true;
+}
+
+/* Set n bits starting at bit_index to value, a word at a time. */
+static void fill_bits(int_t* const buf, size_t bit_index, size_t n, const bool value)
+{
+    const int_t v = value ? ~(int_t)0 : 0;
+    if (n > 0 && bit_index % 64 != 0)
+    {
+        unsigned m = 64 - bit_index % 64;
+        if (m > n) m = n;
+        store_bits(buf, bit_index, m, v);
+        bit_index += m; n -= m;
+    }
+    for (; n >= 64; n -= 64, bit_index += 64)
+        buf[bit_index / 64] = v;
+    if (n > 0)
+        store_bits(buf, bit_index, n, v);
+}
+
+/* The number of words in the buffer of a bit array. */
+static inline size_t bitarray_words(const bitarray_t* const bitarray)
+{
+    return bitarray->bit_sz / 64 + 1;
+}
+
+/* Whether the buffer of a bit array holds chunk c itself. */
+static inline bool cow_has(const bitarray_t* const bitarray, const size_t c)
+{
+    return bitarray->cow_have == NULL || (bitarray->cow_have[c / 8] >> (c % 8)) & 1;
+}
+
+/* The words holding chunk c of a bit array, found by following clones back
+   to the first array whose buffer has the chunk. */
+static const int_t* cow_chunk(const bitarray_t* bitarray, const size_t c)
+{
+    while (!cow_has(bitarray, c))
+        bitarray = bitarray->cow_src;
+    return bitarray->buf + c * COW_CHUNK_WORDS;
+}
+
+/* Copy chunk c, which a clone does not yet have, into its buffer. */
+static void cow_copy_chunk(bitarray_t* const bitarray, const size_t c)
+{
+    const size_t first = c * COW_CHUNK_WORDS;
+    const size_t words = bitarray_words(bitarray) - first < COW_CHUNK_WORDS ?
+        bitarray_words(bitarray) - first : COW_CHUNK_WORDS;
+    memcpy(bitarray->buf + first, cow_chunk(bitarray->cow_src, c), words * sizeof(int_t));
+    bitarray->cow_have[c / 8] |= 1 << (c % 8);
+    if (--bitarray->cow_missing == 0)
+        cow_detach(bitarray);
+}
+
+/* Stop a clone from reading through to its source. */
+static void cow_detach(bitarray_t* const bitarray)
+{
+    bitarray_t** link = &bitarray->cow_src->cow_deps;
+    while (*link != bitarray)
+        link = &(*link)->cow_next_dep;
+    *link = bitarray->cow_next_dep;
+    bitarray->cow_next_dep = NULL;
+    bitarray->cow_src = NULL;
+    free(bitarray->cow_have);
+    bitarray->cow_have = NULL;
+    bitarray->cow_missing = 0;
+}
+
+/* Give the buffer of src, which is about to be freed, to heir, one of the
+   clones reading through it. The chunks heir holds itself are written back
+   over those of src first, and the other clones of src copy those same
+   chunks before they change and then read through heir instead, so the
+   work is proportional to the chunks heir has copied, not to the size of
+   the array. */
+static void cow_hand_over(bitarray_t* const src, bitarray_t* const heir)
+{
+    const size_t words = bitarray_words(heir);
+    const size_t chunks = (words + COW_CHUNK_WORDS - 1) / COW_CHUNK_WORDS;
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        if (!cow_has(heir, c))
+            continue;
+        bitarray_t* next;
+        for (bitarray_t* dep = src->cow_deps; dep != NULL; dep = next)
+        {
+            next = dep->cow_next_dep;
+            if (dep != heir && !cow_has(dep, c))
+                cow_copy_chunk(dep, c);
+        }
+        const size_t first = c * COW_CHUNK_WORDS;
+        const size_t n = words - first < COW_CHUNK_WORDS ? words - first : COW_CHUNK_WORDS;
+        memcpy(src->buf + first, heir->buf + first, n * sizeof(int_t));
+        if (src->cow_have != NULL && !cow_has(src, c))
+        {
+            src->cow_have[c / 8] |= 1 << (c % 8);
+            --src->cow_missing;
+        }
+    }
+
+    /* heir now holds what src held, and reads the rest where src did. */
+    if (heir->map_sz != 0)
+        bitarray_numa_free(heir->buf, heir->map_sz);
+    else
+        free(heir->buf);
+    heir->buf = src->buf;
+    heir->cap_words = src->cap_words;
+    heir->map_sz = src->map_sz;
+    heir->numa_policy = src->numa_policy;
+    heir->numa_threads = src->numa_threads;
+    src->buf = NULL;
+    src->map_sz = 0;
+
+    bitarray_t** link = &src->cow_deps;
+    while (*link != heir)
+        link = &(*link)->cow_next_dep;
+    *link = heir->cow_next_dep;
+    free(heir->cow_have);
+    heir->cow_have = src->cow_have;
+    heir->cow_missing = src->cow_missing;
+    heir->cow_src = src->cow_src;
+    heir->cow_next_dep = NULL;
+    src->cow_have = NULL;
+    src->cow_missing = 0;
+    if (src->cow_src != NULL)
+    {
+        link = &src->cow_src->cow_deps;
+        while (*link != src)
+            link = &(*link)->cow_next_dep;
+        *link = heir;
+        heir->cow_next_dep = src->cow_next_dep;
+        src->cow_src = NULL;
+        src->cow_next_dep = NULL;
+        if (heir->cow_missing == 0)
+            cow_detach(heir);
+    }
+
+    /* The remaining clones of src join those of heir. */
+    while (src->cow_deps != NULL)
+    {
+        bitarray_t* const dep = src->cow_deps;
+        src->cow_deps = dep->cow_next_dep;
+        dep->cow_src = heir;
+        dep->cow_next_dep = heir->cow_deps;
+        heir->cow_deps = dep;
+    }
+}
+
+/* Give a bit array and its clones separate copies of every chunk, so that
+   its size can change. */
+static void cow_unshare(bitarray_t* const bitarray)
+{
+    if (bitarray->cow_src != NULL || bitarray->cow_deps != NULL)
+        cow_prepare_write(bitarray, 0, bitarray_words(bitarray) - 1);
+}
+
+/* Make words [first_word, last_word] of a bit array safe to write: clones
+   reading those chunks through it get their own copies of the current
+   contents first, and chunks it reads through its own source are copied
+   into its buffer. */
+static void cow_prepare_write(bitarray_t* const bitarray,
+                              const size_t first_word,
+                              const size_t last_word)
+{
+    assert(!bitarray->cow_read_only);
+    for (size_t c = first_word / COW_CHUNK_WORDS;
+         c <= last_word / COW_CHUNK_WORDS &&
+             (bitarray->cow_src != NULL || bitarray->cow_deps != NULL);
+         ++c)
+    {
+        bitarray_t* next;
+        for (bitarray_t* dep = bitarray->cow_deps; dep != NULL; dep = next)
+        {
+            next = dep->cow_next_dep;
+            if (!cow_has(dep, c))
+                cow_copy_chunk(dep, c);
+        }
+        if (!cow_has(bitarray, c))
+            cow_copy_chunk(bitarray, c);
+    }
+}
+
+/* Rotate [bit_offset, bit_offset + bit_length) right by 0 < shift_ <
+   bit_length places. */
+static void bitarray_rotate_in_place(bitarray_t* const bitarray,
+                                     const size_t bit_offset,
+                                     const size_t bit_length,
+                                     const size_t shift_)
+{
+    /* Rotating right by shift_ moves the last b bits in front of the
+       first a. */
+    size_t p = bit_offset;
+    size_t a = bit_length - shift_;
+    size_t b = shift_;
+
+    while (a > 0 && b > 0)
+    {
+        /* Once the smaller piece fits beside the range in the LLC, move
+           both pieces straight to their final place in one pass. */
+        const size_t small = a < b ? a : b;
+        if (small / 8 <= ROTATE_BUF_BYTES &&
+            bitarray_rotate_staged(bitarray, p, p + a, p + a + b - 1))
+            return;
+
+        /* Until then, swap the smaller piece with the block of the other
+           that sits where it belongs (Gries and Mills). That block is
+           final; what remains is a smaller rotation of the same kind. */
+        if (a <= b)
+        {
+            /* a b1 b2 -> b2 b1 a, leaving b2 b1 to become b1 b2. */
+            swap_bits(bitarray->buf, p, p + b, a);
+            b -= a;
+        }
+        else
+        {
+            /* a1 a2 b -> b a2 a1, leaving a2 a1 to become a1 a2. */
+            swap_bits(bitarray->buf, p, p + a, b);
+            p += b;
+            a -= b;
+        }
+    }
+}
+
+static bool plan_push(bitarray_plan_t* const plan, const struct plan_op* const op)
+{
+    if (plan->nops == plan->cap)
+    {
+        const size_t cap = plan->cap ? 2 * plan->cap : 16;
+        struct plan_op* const ops = realloc(plan->ops, cap * sizeof(struct plan_op));
+        if (ops == NULL)
+            return false;
+        STATS_ALLOC(cap * sizeof(struct plan_op));
+        plan->ops = ops;
+        plan->cap = cap;
+    }
+    plan->ops[plan->nops++] = *op;
+    return true;
+}
+
+/* Push an OP_GATHER, first adding the masks of its stages to the plan
+   unless the CPU can run it as a pext/pdep pair. */
+static bool plan_push_gather(bitarray_plan_t* const plan,
+                             struct plan_op* const op,
+                             const bool bmi2)
+{
+    if (!bmi2)
+    {
+        if (plan->nstages + GATHER_STAGES > plan->stages_cap)
+        {
+            const size_t cap = plan->stages_cap ? 2 * plan->stages_cap : 16 * GATHER_STAGES;
+            int_t* const stages = realloc(plan->stages, cap * sizeof(int_t));
+            if (stages == NULL)
+                return false;
+            STATS_ALLOC(cap * sizeof(int_t));
+            plan->stages = stages;
+            plan->stages_cap = cap;
+        }
+        op->stages = plan->nstages;
+        compress_stages(op->src_mask, &plan->stages[plan->nstages]);
+        compress_stages(op->dst_mask, &plan->stages[plan->nstages + GATHER_STAGES / 2]);
+        plan->nstages += GATHER_STAGES;
+    }
+    return plan_push(plan, op);
+}
+
+/* Emit ops moving the n bits, in source order, that one source word sends
+   outside of runs: they are stably sorted by destination word, which an
+   insertion sort does for free when the destinations already rise, and
+   compiled one (source word, destination word) pair at a time. */
+static bool plan_compile_word(bitarray_plan_t* const plan,
+                              struct plan_bit* const bits,
+                              const size_t n)
+{
+    for (size_t k = 1; k < n; ++k)
+    {
+        const struct plan_bit bit = bits[k];
+        size_t j = k;
+        for (; j > 0 && bits[j - 1].dst / 64 > bit.dst / 64; --j)
+            bits[j] = bits[j - 1];
+        bits[j] = bit;
+    }
+    for (size_t first = 0, last; first < n; first = last)
+    {
+        for (last = first + 1; last < n && bits[last].dst / 64 == bits[first].dst / 64; ++last)
+            ;
+        if (!plan_compile_pair(plan, bits + first, last - first))
+            return false;
+    }
+    return true;
+}
+
+/* Emit ops moving n bits, sorted by source index, from one source word to
+   one destination word. Bits that move by the same distance share a
+   shift-and-mask op. The bits can instead be split into chains whose
+   destinations rise with their sources; each chain is one pext/pdep pair,
+   or its twelve shift-and-mask stages on a CPU without BMI2, which wins
+   when the bits scatter over many distances. */
+static bool plan_compile_pair(bitarray_plan_t* const plan,
+                              const struct plan_bit* const bits,
+                              const size_t n)
+{
+    const size_t src_word = bits[0].src / 64;
+    const size_t dst_word = bits[0].dst / 64;
+
+    /* Masks by shift distance, indexed by delta + 63. */
+    int_t src_by_delta[127] = {0};
+    unsigned ndeltas = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        const int delta = (int)(bits[k].dst % 64) - (int)(bits[k].src % 64);
+        if (src_by_delta[delta + 63] == 0)
+            ndeltas++;
+        src_by_delta[delta + 63] |= top_mask(1) >> (bits[k].src % 64);
+    }
+
+    /* First-fit chains; the last destination of each is kept in chain_end. */
+    int_t src_by_chain[64] = {0};
+    int_t dst_by_chain[64] = {0};
+    unsigned chain_end[64];
+    unsigned nchains = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        const unsigned d = bits[k].dst % 64;
+        unsigned c = 0;
+        while (c < nchains && chain_end[c] >= d)
+            ++c;
+        if (c == nchains)
+            nchains++;
+        chain_end[c] = d;
+        src_by_chain[c] |= top_mask(1) >> (bits[k].src % 64);
+        dst_by_chain[c] |= top_mask(1) >> d;
+    }
+    const bool bmi2 = CPU_HAS_BMI2();
+    if (nchains * (bmi2 ? 1 : PLAN_GATHER_STAGES_COST) < ndeltas)
+    {
+        for (unsigned c = 0; c < nchains; ++c)
+        {
+            struct plan_op op = {.kind = OP_GATHER, .src = src_word, .dst = dst_word,
+                                 .src_mask = src_by_chain[c], .dst_mask = dst_by_chain[c]};
+            if (!plan_push_gather(plan, &op, bmi2))
+                return false;
+        }
+        return true;
     }
 
-    buf = NULL;
+    for (int delta = -63; delta <= 63; ++delta)
+    {
+        if (src_by_delta[delta + 63] == 0)
+            continue;
+        struct plan_op op = {.kind = OP_SHIFT, .src = src_word, .dst = dst_word,
+                             .src_mask = src_by_delta[delta + 63], .delta = delta};
+        if (!plan_push(plan, &op))
+            return false;
+    }
+    return true;
+}
+
+/* Fill stages with the six masks that compress the bits of a word selected
+   by mask into its low end, keeping their order: stage i moves each bit
+   right by 2^i places if it is set in stages[i] (Hacker's Delight, 7-4). */
+static void compress_stages(int_t mask, int_t* const stages)
+{
+    /* Bit k of mk is set if the number of clear mask bits below k is odd
+       at the current stage; those are the bits that move. */
+    int_t mk = ~mask << 1;
+    for (unsigned i = 0; i < GATHER_STAGES / 2; ++i)
+    {
+        int_t mp = mk ^ (mk << 1);
+        mp ^= mp << 2;
+        mp ^= mp << 4;
+        mp ^= mp << 8;
+        mp ^= mp << 16;
+        mp ^= mp << 32;
+        const int_t mv = mp & mask;
+        stages[i] = mv;
+        mask = (mask ^ mv) | (mv >> (1u << i));
+        mk &= ~mp;
+    }
+}
+
+/* pdep(pext(x, src_mask), dst_mask) without BMI2: compress the source bits
+   with the first six stages, then expand them by running the stages of
+   the destination mask backwards. */
+static inline int_t gather_stages(int_t x,
+                                  const int_t src_mask,
+                                  const int_t dst_mask,
+                                  const int_t* const stages)
+{
+    x &= src_mask;
+    for (unsigned i = 0; i < GATHER_STAGES / 2; ++i)
+    {
+        const int_t t = x & stages[i];
+        x = (x ^ t) | (t >> (1u << i));
+    }
+    for (unsigned i = GATHER_STAGES / 2; i-- > 0;)
+    {
+        const int_t mv = stages[GATHER_STAGES / 2 + i];
+        x = (x & ~mv) | ((x << (1u << i)) & mv);
+    }
+    return x & dst_mask;
+}
+
+#if defined(HAVE_CPU_DISPATCH)
+__attribute__((target("bmi2")))
+static int_t gather_bmi2(const int_t x, const int_t src_mask, const int_t dst_mask)
+{
+    return _pdep_u64(_pext_u64(x, src_mask), dst_mask);
+}
+#endif
+
+#ifdef BITARRAY_STATS
+/* The counters of the calling thread, registered on first use. */
+static struct stats_thread* stats_thread(void)
+{
+    if (stats_self == NULL)
+    {
+        struct stats_thread* const t = calloc(1, sizeof(struct stats_thread));
+        if (t == NULL)
+            return NULL;
+        t->current = -1;
+        t->generation = __atomic_load_n(&stats_generation, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&stats_lock);
+        t->id = stats_nthreads++;
+        t->next = stats_threads;
+        stats_threads = t;
+        pthread_mutex_unlock(&stats_lock);
+        stats_self = t;
+    }
+    return stats_self;
+}
+
+/* Wall-clock nanoseconds from CLOCK_MONOTONIC. The process CPU clock would
+   charge a call for the time every other thread spends working, and miss
+   the time this one spends waiting. */
+static inline uint64_t stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Whether the counters of a thread have been zeroed since the last reset. */
+static inline bool stats_current(struct stats_thread* const t)
+{
+    return __atomic_load_n(&t->generation, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&stats_generation, __ATOMIC_ACQUIRE);
+}
+
+static struct stats_scope stats_enter(const enum stats_fn fn, const size_t nbits)
+{
+    struct stats_scope scope = {.thread = NULL, .fn = fn, .start = 0};
+    struct stats_thread* const t = stats_thread();
+    if (t == NULL || t->current != -1)
+        return scope;
+    if (!stats_current(t))
+    {
+        stats_zero(t->fn);
+        __atomic_store_n(&t->generation, __atomic_load_n(&stats_generation, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+    t->current = fn;
+    stats_add(&t->fn[fn].calls, 1);
+    stats_add(&t->fn[fn].bits, nbits);
+    scope.thread = t;
+    scope.start = stats_now();
+    return scope;
+}
+
+static void stats_leave(struct stats_scope* const scope)
+{
+    if (scope->thread == NULL)
+        return;
+    const uint64_t ns = stats_now() - scope->start;
+    const int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    struct stats_counters* const c = &scope->thread->fn[scope->fn];
+    stats_add(&c->latency[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1);
+    scope->thread->current = -1;
+}
+
+static void stats_alloc(const size_t bytes)
+{
+    struct stats_thread* const t = stats_self;
+    if (t == NULL || t->current == -1)
+        return;
+    stats_add(&t->fn[t->current].allocs, 1);
+    stats_add(&t->fn[t->current].alloc_bytes, bytes);
+}
+
+/* Add n to a counter of the calling thread. Only that thread writes it,
+   so a relaxed load and store do, without a locked add. */
+static inline void stats_add(uint64_t* const counter, const uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/* Zero the counters of the calling thread. */
+static void stats_zero(struct stats_counters* const fn)
+{
+    for (int f = 0; f < STATS_FN_COUNT; ++f)
+    {
+        __atomic_store_n(&fn[f].calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&fn[f].bits, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&fn[f].allocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&fn[f].alloc_bytes, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; ++b)
+            __atomic_store_n(&fn[f].latency[b], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Copy the counters of any thread for a dump. A thread in the middle of a
+   call may have counted some of it and not the rest. */
+static void stats_copy(struct stats_counters* const dst,
+                       const struct stats_counters* const src)
+{
+    for (int f = 0; f < STATS_FN_COUNT; ++f)
+    {
+        dst[f].calls = __atomic_load_n(&src[f].calls, __ATOMIC_RELAXED);
+        dst[f].bits = __atomic_load_n(&src[f].bits, __ATOMIC_RELAXED);
+        dst[f].allocs = __atomic_load_n(&src[f].allocs, __ATOMIC_RELAXED);
+        dst[f].alloc_bytes = __atomic_load_n(&src[f].alloc_bytes, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_BUCKETS; ++b)
+            dst[f].latency[b] = __atomic_load_n(&src[f].latency[b], __ATOMIC_RELAXED);
+    }
+}
+
+/* Print the functions that were called as ", \"functions\": {...}". The
+   latency array runs up to the highest non-empty bucket. */
+static void stats_fprint(FILE* const stream, const struct stats_counters* const fn)
+{
+    bool first = true;
+    fprintf(stream, ", \"functions\": {");
+    for (int f = 0; f < STATS_FN_COUNT; ++f)
+    {
+        if (fn[f].calls == 0)
+            continue;
+        fprintf(stream, "%s\n    \"%s\": {\"calls\": %llu, \"bits\": %llu, "
+                "\"allocs\": %llu, \"alloc_bytes\": %llu, \"latency_ns_log2\": [",
+                first ? "" : ",", stats_names[f],
+                (unsigned long long)fn[f].calls, (unsigned long long)fn[f].bits,
+                (unsigned long long)fn[f].allocs, (unsigned long long)fn[f].alloc_bytes);
+        int last = STATS_BUCKETS - 1;
+        while (last > 0 && fn[f].latency[last] == 0)
+            --last;
+        for (int b = 0; b <= last; ++b)
+            fprintf(stream, "%s%llu", b == 0 ? "" : ", ", (unsigned long long)fn[f].latency[b]);
+        fprintf(stream, "]}");
+        first = false;
+    }
+    fprintf(stream, "}");
+}
+#endif
+
+/* Load n (1 <= n <= 64) bits starting at bit_index like load_bits, reading
+   through to the source of a clone for chunks its buffer does not have. */
+static inline int_t load_bits_shared(const bitarray_t* const bitarray,
+                                     const size_t bit_index,
+                                     const unsigned n)
+{
+    if (bitarray->cow_have == NULL)
+        return load_bits(bitarray->buf, bit_index, n);
+    const size_t w = bit_index / 64;
+    const unsigned o = bit_index % 64;
+    int_t v = cow_chunk(bitarray, w / COW_CHUNK_WORDS)[w % COW_CHUNK_WORDS] << o;
+    if (o + n > 64)
+        v |= cow_chunk(bitarray, (w + 1) / COW_CHUNK_WORDS)[(w + 1) % COW_CHUNK_WORDS] >>
+            (64 - o);
+    return v & top_mask(n);
+}
+
+/* Word k of the bits starting shift (0 <= shift < 64) bits into buf. Word
+   k + 1 of buf is read even when shift is 0, so it must exist; shifting by
+   one and then 63 - shift keeps every shift in range without a branch. */
+static inline int_t shifted_word(const int_t* const buf,
+                                 const size_t k,
+                                 const unsigned shift)
+{
+    return (buf[k] << shift) | ((buf[k + 1] >> 1) >> (63 - shift));
+}
+
+/* The number of differing bits between nwords words of a and as many words
+   starting b_shift bits into b, on the popcnt instruction if the CPU has
+   it. */
+static size_t hamming_words(const int_t* const a,
+                            const int_t* const b,
+                            const unsigned b_shift,
+                            const size_t nwords)
+{
+#if defined(HAVE_CPU_DISPATCH)
+    if (CPU_HAS_POPCNT())
+        return hamming_words_popcnt(a, b, b_shift, nwords);
+#endif
+    return hamming_words_inline(a, b, b_shift, nwords);
+}
+
+/* The loop of hamming_words. It has no branches and keeps four independent
+   sums, so four scalar popcounts are in flight at once. It has no vector
+   path on purpose: one popcnt per word already counts about as fast as
+   the two ranges can be read. */
+static ALWAYS_INLINE size_t hamming_words_inline(const int_t* const a,
+                                                 const int_t* const b,
+                                                 const unsigned b_shift,
+                                                 const size_t nwords)
+{
+    size_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t k = 0;
+    for (; k + 4 <= nwords; k += 4)
+    {
+        c0 += POPCOUNT(a[k] ^ shifted_word(b, k, b_shift));
+        c1 += POPCOUNT(a[k + 1] ^ shifted_word(b, k + 1, b_shift));
+        c2 += POPCOUNT(a[k + 2] ^ shifted_word(b, k + 2, b_shift));
+        c3 += POPCOUNT(a[k + 3] ^ shifted_word(b, k + 3, b_shift));
+    }
+    for (; k < nwords; ++k)
+        c0 += POPCOUNT(a[k] ^ shifted_word(b, k, b_shift));
+    return c0 + c1 + c2 + c3;
+}
+
+/* The index of the first of nwords words of a that differs from the word
+   as far into the bits starting b_shift bits into b, or nwords if none
+   does. Four words are tested per branch. */
+static size_t compare_words(const int_t* const a,
+                            const int_t* const b,
+                            const unsigned b_shift,
+                            const size_t nwords)
+{
+    size_t k = 0;
+    for (; k + 4 <= nwords; k += 4)
+    {
+        const int_t diff = (a[k] ^ shifted_word(b, k, b_shift)) |
+            (a[k + 1] ^ shifted_word(b, k + 1, b_shift)) |
+            (a[k + 2] ^ shifted_word(b, k + 2, b_shift)) |
+            (a[k + 3] ^ shifted_word(b, k + 3, b_shift));
+        if (diff != 0)
+            break;
+    }
+    for (; k < nwords; ++k)
+        if (a[k] != shifted_word(b, k, b_shift))
+            break;
+    return k;
+}
+
+/* Spread every bit of h over the whole result (the MurmurHash3 finalizer). */
+static uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#if !defined(__GNUC__)
+static inline size_t popcount_word(int_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (size_t)((x * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+/* Feed nwords whole words, starting shift bits into words, to the three
+   CRC32C lanes of bitarray_hash_range in turn, on the crc32 instruction
+   if sse42. */
+static void hash_words(const int_t* const words,
+                       const unsigned shift,
+                       const size_t nwords,
+                       uint32_t* const crc,
+                       const bool sse42)
+{
+#if defined(HAVE_CPU_DISPATCH)
+    if (sse42)
+    {
+        hash_words_sse42(words, shift, nwords, crc);
+        return;
+    }
+#endif
+    hash_words_inline(words, shift, nwords, crc, false);
+}
+
+/* The loop of hash_words. */
+static ALWAYS_INLINE void hash_words_inline(const int_t* const words,
+                                            const unsigned shift,
+                                            const size_t nwords,
+                                            uint32_t* const crc,
+                                            const bool sse42)
+{
+    for (size_t k = 0; k + 3 <= nwords; k += 3)
+    {
+        crc[0] = crc32c_word(sse42, crc[0], shifted_word(words, k, shift));
+        crc[1] = crc32c_word(sse42, crc[1], shifted_word(words, k + 1, shift));
+        crc[2] = crc32c_word(sse42, crc[2], shifted_word(words, k + 2, shift));
+    }
+}
+
+/* CRC32C (Castagnoli) of a word, one instruction if sse42 and a byte table
+   otherwise. Both feed the word in little-endian byte order, so they
+   agree. */
+static ALWAYS_INLINE uint32_t crc32c_word(const bool sse42, uint32_t crc, int_t x)
+{
+#if defined(HAVE_CPU_DISPATCH)
+    if (sse42)
+        return crc32c_word_sse42(crc, x);
+#else
+    (void)sse42;
+#endif
+    for (int i = 0; i < 8; ++i, x >>= 8)
+        crc = crc32c_table[(crc ^ x) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static void build_crc32c_table(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+        crc32c_table[i] = crc;
+    }
+}
+
+#if defined(HAVE_CPU_DISPATCH)
+/* Copies of the loops above compiled for the instructions they need; the
+   generic loops inlined into them pick those instructions up. */
+__attribute__((target("popcnt")))
+static size_t hamming_words_popcnt(const int_t* const a,
+                                   const int_t* const b,
+                                   const unsigned b_shift,
+                                   const size_t nwords)
+{
+    return hamming_words_inline(a, b, b_shift, nwords);
+}
+
+__attribute__((target("sse4.2")))
+static void hash_words_sse42(const int_t* const words,
+                             const unsigned shift,
+                             const size_t nwords,
+                             uint32_t* const crc)
+{
+    hash_words_inline(words, shift, nwords, crc, true);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_word_sse42(const uint32_t crc, const int_t x)
+{
+    return (uint32_t)_mm_crc32_u64(crc, x);
 }
+#endif
 
-static int modulo(const int x, const int y)
+/* x mod y in [0, y), exactly, for any x and any y that fits in a ssize_t;
+   0 if y is 0. The remainder of a negative x is negative, and adding y to
+   it as an unsigned number wraps it into range. */
+static size_t modulo(const ssize_t x, const size_t y)
 {
     if (y == 0) return 0;
-    return x - y * (int)(floorf((float)x / (float)y));
+    return ((size_t)(x % (ssize_t)y) + y) % y;
 }
 
 static void build_setbit_array(const size_t int_sz)
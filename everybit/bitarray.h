@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 /***************************************************************************/
 /* Types                                                                   */
@@ -11,6 +12,16 @@
 
 typedef uint64_t int_t;
 typedef struct bitarray bitarray_t; /* ADT representing an array of bits */
+typedef struct bitarray_plan bitarray_plan_t; /* A compiled bit permutation */
+
+/* Where the pages of a bit array buffer are placed on a NUMA host. */
+typedef enum {
+    BITARRAY_NUMA_DEFAULT,    /* On the node of whichever thread zeroes them */
+    BITARRAY_NUMA_LOCAL,      /* On the node of the allocating thread */
+    BITARRAY_NUMA_INTERLEAVE, /* Round-robin across all allowed nodes */
+    BITARRAY_NUMA_PARTITION   /* In contiguous slices, one per thread, each
+                                 preferring a node of its own */
+} bitarray_numa_t;
 
 /***************************************************************************/
 /* Prototypes                                                              */
@@ -21,14 +32,73 @@ typedef struct bitarray bitarray_t; /* ADT representing an array of bits */
 */
 bitarray_t* bitarray_new(const size_t bit_sz);
 
-/* Free a bit array allocated by bitarray_new. */
+/* Allocate space for a new bit array, placing its buffer according to
+   policy. With BITARRAY_NUMA_PARTITION, the buffer is split into nthreads
+   equal slices (one per online CPU if nthreads is 0), and slice i prefers
+   node i * nodes / nthreads, nodes being bitarray_numa_node_count(): its
+   pages go elsewhere only when that node is full. With one slice per node,
+   slice i is on node i, next to a worker that splits the array the same
+   way and calls bitarray_numa_run_on_node(i).
+   BITARRAY_NUMA_DEFAULT behaves exactly like bitarray_new.
+*/
+bitarray_t* bitarray_new_numa(const size_t bit_sz,
+                              const bitarray_numa_t policy,
+                              const unsigned nthreads);
+
+/* Free a bit array allocated by bitarray_new or bitarray_new_numa. */
 void bitarray_free(bitarray_t* const bitarray);
 
+/* Make a copy of a bit array in time proportional to its number of chunks
+   rather than its size. The copy shares the buffer of bitarray in 4 KiB
+   chunks; a chunk is duplicated only when bitarray_set, bitarray_rotate or
+   bitarray_randfill is about to write to it in either array, so memory
+   grows only with what changes. Both arrays stay writable and can be freed
+   in either order.
+
+   Arrays sharing chunks are not independent: they must not be used from
+   different threads at the same time, including through
+   bitarray_rotate_async.
+*/
+bitarray_t* bitarray_clone(bitarray_t* const bitarray);
+
+/* Like bitarray_clone, but the copy is a read-only checkpoint; writing to it
+   is an error. To roll back to a snapshot, free the modified array and carry
+   on with bitarray_clone(snapshot). Freeing an array that clones still read
+   through hands its buffer to one of them, writing back only the chunks
+   that clone copied before they changed, so a rollback costs about what was
+   written since the snapshot rather than a copy of the array.
+*/
+bitarray_t* bitarray_snapshot(bitarray_t* const bitarray);
+
 /* Get the number of bits stored in a bit array.
    Invariant: bitarray_get_bit_sz(bitarray_new(n)) = n.
 */
 size_t bitarray_get_bit_sz(const bitarray_t* const bitarray);
 
+/* Make room for a bit array to hold bit_capacity bits without reallocating.
+   Returns false if memory runs out. The size of the array is unchanged.
+*/
+bool bitarray_reserve(bitarray_t* const bitarray, const size_t bit_capacity);
+
+/* Insert n bits, all set to value, before bit_index, growing the array by
+   n bits; bit_index may equal the size of the array to append. The bits
+   from bit_index on are shifted up in a single word-at-a-time pass, and the
+   capacity at least doubles whenever it has to grow. Returns false, leaving
+   the array unchanged, if memory runs out.
+*/
+bool bitarray_insert_bits(bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const size_t n,
+                          const bool value);
+
+/* Remove the n bits starting at bit_index, shrinking the array by n bits
+   and shifting the bits after them down in a single pass. The capacity is
+   kept for later growth.
+*/
+void bitarray_erase_bits(bitarray_t* const bitarray,
+                         const size_t bit_index,
+                         const size_t n);
+
 /* Fill in random bits the enitre bit array */
 void bitarray_randfill(bitarray_t* const bitarray);
 
@@ -40,6 +110,47 @@ extern void bitarray_set(bitarray_t* const bitarray,
                   const size_t bit_index,
                   const bool value);
 
+/* Copy the bit_length bits starting at bit_index into words, 64 to a word
+   in setbit order: bit k of the range lands in words[k / 64] at
+   1 << (63 - k % 64). The unused low bits of the last word are cleared.
+   words must hold (bit_length + 63) / 64 words.
+*/
+void bitarray_get_range(const bitarray_t* const bitarray,
+                        const size_t bit_index,
+                        const size_t bit_length,
+                        int_t* const words);
+
+/* Copy bit_length bits from words, laid out as bitarray_get_range lays
+   them out, into the bit array at bit_index, a word at a time. The bits
+   around the range are left untouched.
+*/
+void bitarray_set_range(bitarray_t* const bitarray,
+                        const size_t bit_index,
+                        const size_t bit_length,
+                        const int_t* const words);
+
+/* Get the words first_word to last_word of a bit array for reading in
+   place, laid out as bitarray_get_range lays out bits: bit k of the array
+   is in word k / 64 at 1 << (63 - k % 64). Only whole words of the array
+   can be asked for. Returns NULL if some of them still live in the buffer
+   of the array this one was cloned from; bitarray_get_range can read those.
+   The pointer stays valid until the array, or an array it shares chunks
+   with, is next resized or freed.
+*/
+const int_t* bitarray_view_words(const bitarray_t* const bitarray,
+                                 const size_t first_word,
+                                 const size_t last_word);
+
+/* Like bitarray_view_words, but for writing as well: the words are first
+   made the array's own, as a write to them would, so the pointer is never
+   NULL. Writing through it is only safe until the array is next cloned
+   or snapshotted, since the words then become shared again; past that it
+   lasts as a bitarray_view_words pointer does.
+*/
+int_t* bitarray_edit_words(bitarray_t* const bitarray,
+                           const size_t first_word,
+                           const size_t last_word);
+
 /* Rotate a subarray.
    
    bit_offset is the index of the start of the subarray
@@ -70,4 +181,108 @@ void bitarray_rotate(bitarray_t* const bitarray,
                      const size_t bit_length,
                      const ssize_t shift);
 
+/* Compile a permutation of bit_length bits into a plan that
+   bitarray_permute can apply any number of times. Bit i of the permuted
+   range moves to position perm[i] of it. Returns NULL if perm is not a
+   permutation of [0, bit_length) or memory runs out.
+
+   Runs of at least 64 bits that stay together become word moves, and the
+   remaining bits become one op per source word, destination word and shift
+   distance. Bits of one word that scatter over many distances but keep
+   their order are moved together instead: by a pext/pdep pair on a CPU
+   with BMI2, checked at run time, and otherwise by a dozen shift-and-mask
+   stages that compress and then expand them. Compiling takes time linear
+   in bit_length. A rotation compiles to the in-place rotation that
+   bitarray_rotate uses.
+
+   Example:
+   Interleaving the two halves of a range of 2n bits, so that bit k of each
+   half ends up next to bit k of the other, is perm[i] = 2 * i for i < n and
+   perm[i] = 2 * (i - n) + 1 for i >= n.
+ */
+bitarray_plan_t* bitarray_plan_new(const size_t* const perm, const size_t bit_length);
+
+/* Compile the plan for rotating bit_length bits right by shift places, as
+   described for bitarray_rotate. */
+bitarray_plan_t* bitarray_plan_rotate(const size_t bit_length, const ssize_t shift);
+
+/* Free a plan made by bitarray_plan_new or bitarray_plan_rotate. */
+void bitarray_plan_free(bitarray_plan_t* const plan);
+
+/* Get the number of bits a plan permutes. */
+size_t bitarray_plan_length(const bitarray_plan_t* const plan);
+
+/* Apply a plan to the bitarray_plan_length(plan) bits starting at
+   bit_offset. Returns false, leaving the bits untouched, if no scratch
+   memory could be had; a rotation plan needs none. bitarray_rotate is
+   bitarray_permute with the plan of bitarray_plan_rotate, built on the
+   stack.
+ */
+bool bitarray_permute(bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const bitarray_plan_t* const plan);
+
+/* Count the bits that differ between the bit_length bits of a starting at
+   a_offset and those of b starting at b_offset. The offsets need not share
+   an alignment: each word of a is compared with a word of b shifted into
+   line, in a branch-free loop that uses the popcnt instruction when the CPU
+   has it, so a count runs at about the speed the two ranges can be read.
+   a and b may be the same array, and the ranges may overlap.
+*/
+size_t bitarray_hamming(const bitarray_t* const a,
+                        const size_t a_offset,
+                        const bitarray_t* const b,
+                        const size_t b_offset,
+                        const size_t bit_length);
+
+/* Compare the bit_length bits of a starting at a_offset with those of b
+   starting at b_offset, as bitarray_hamming lines them up. Returns 0 if
+   they are equal, and otherwise a negative number if the first bit that
+   differs is clear in a, a positive one if it is set. The scan stops at
+   the first differing word.
+*/
+int bitarray_compare_range(const bitarray_t* const a,
+                           const size_t a_offset,
+                           const bitarray_t* const b,
+                           const size_t b_offset,
+                           const size_t bit_length);
+
+/* Hash the bit_length bits of a bit array starting at bit_offset. The hash
+   depends only on the bits in the range and its length, never on where the
+   range starts, so equal ranges hash equally at any offset in any array.
+   It is a 64-bit CRC32C-based hash, not a cryptographic one. On a CPU with
+   SSE4.2, checked at run time, it takes one crc32 instruction per word.
+*/
+uint64_t bitarray_hash_range(const bitarray_t* const bitarray,
+                             const size_t bit_offset,
+                             const size_t bit_length);
+
+/* Estimate the bytes of DRAM traffic bitarray_rotate generates for a
+   rotation of bit_length bits by shift places, assuming the range starts out
+   in memory rather than in cache. The estimate follows the schedule
+   bitarray_rotate picks for those arguments; the benchmark divides it by the
+   size of the range to report DRAM bytes per rotated byte.
+ */
+size_t bitarray_rotate_dram_bytes(const size_t bit_length, const ssize_t shift);
+
+/* Write the statistics gathered by a build with BITARRAY_STATS defined
+   (make STATS=1) to stream as JSON. Each thread that called the library
+   has its own counters, listed under "threads" and summed under "total".
+   For every public function called, they hold the number of calls, the
+   bits those calls read or wrote, the allocations they made and the bytes
+   allocated, and a latency histogram whose entry b counts calls that took
+   between 2^(b-1) and 2^b nanoseconds of wall-clock (CLOCK_MONOTONIC)
+   time. Calls the library makes to itself count toward the outermost call.
+   Other threads may be counting while the dump runs; a call of theirs in
+   progress may then show up only in part. Without BITARRAY_STATS, the
+   dump reports statistics as disabled, and the library spends nothing on
+   them.
+ */
+void bitarray_stats_dump(FILE* const stream);
+
+/* Zero the statistics of every thread. Other threads may be counting at the
+   time: each zeroes its own counters at its next call, and until then dumps
+   leave it out. */
+void bitarray_stats_reset(void);
+
 #endif // BITARRAY_H
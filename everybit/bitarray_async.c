@@ -0,0 +1,350 @@
+/* Implements the asynchronous rotation queue specified in bitarray_async.h
+   on a pool of POSIX threads. Queued jobs are grouped into one lane per bit
+   array; a worker takes the next job from a ready lane and keeps the lane to
+   itself until that job finishes, which serializes jobs on the same array
+   while letting lanes for different arrays run in parallel.
+ */
+
+#include "./bitarray_async.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+/***************************************************************************/
+/* Macros                                                                  */
+/***************************************************************************/
+
+/* Number of hash buckets used to find the lane of an array. */
+#define LANE_BUCKETS 64
+
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+struct bitarray_job {
+    bitarray_t* bitarray; /* The array to rotate */
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t shift;
+    bool rotated; /* Set once the rotation has completed */
+    bool done; /* Set once the callback, if any, has also returned */
+    bitarray_job_callback_t callback; /* Run on completion, if not NULL */
+    void* arg;
+    struct bitarray_job* next; /* The next job queued on the same array */
+};
+
+/* The jobs queued against one array, oldest first. A lane sits on the ready
+   list while it has jobs and no worker is running one of them. */
+struct lane {
+    bitarray_t* bitarray;
+    bitarray_job_t* head;
+    bitarray_job_t* tail;
+    bool running; /* A worker is running the job taken from head */
+    struct lane* next_ready;
+    struct lane* next_bucket;
+};
+
+struct pool {
+    pthread_mutex_t lock; /* Guards everything below, and every job */
+    pthread_cond_t work; /* Signalled when a lane becomes ready */
+    pthread_cond_t done; /* Broadcast when a job completes */
+    pthread_t* threads;
+    unsigned nthreads;
+    bool running;
+    bool stopping;
+    size_t pending; /* Jobs queued or running */
+    struct lane* buckets[LANE_BUCKETS];
+    struct lane* ready_head;
+    struct lane* ready_tail;
+};
+
+static struct pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/***************************************************************************/
+/* Prototypes for static functions                                         */
+/***************************************************************************/
+
+static bool pool_start_locked(unsigned nthreads);
+static void* pool_worker(void* unused);
+static struct lane** lane_bucket(const bitarray_t* const bitarray);
+static struct lane* lane_get(bitarray_t* const bitarray);
+static void lane_remove(struct lane* const lane);
+static void ready_push(struct lane* const lane);
+static struct lane* ready_pop(void);
+
+/***************************************************************************/
+/* Functions                                                               */
+/***************************************************************************/
+
+bool bitarray_async_init(const unsigned nthreads)
+{
+    pthread_mutex_lock(&pool.lock);
+    const bool started = !pool.running && pool_start_locked(nthreads);
+    pthread_mutex_unlock(&pool.lock);
+    return started;
+}
+
+void bitarray_async_shutdown(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.running)
+    {
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (unsigned i = 0; i < pool.nthreads; ++i)
+        pthread_join(pool.threads[i], NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+    pool.running = false;
+    pool.stopping = false;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+bitarray_job_t* bitarray_rotate_async(bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length,
+                                      const ssize_t shift)
+{
+    assert(bitarray != NULL);
+    assert(bit_offset + bit_length <= bitarray_get_bit_sz(bitarray));
+
+    bitarray_job_t* const job = malloc(sizeof(struct bitarray_job));
+    if (job == NULL)
+        return NULL;
+    job->bitarray = bitarray;
+    job->bit_offset = bit_offset;
+    job->bit_length = bit_length;
+    job->shift = shift;
+    job->rotated = false;
+    job->done = false;
+    job->callback = NULL;
+    job->arg = NULL;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    struct lane* lane = NULL;
+    if ((pool.running || pool_start_locked(0)) && !pool.stopping)
+        lane = lane_get(bitarray);
+    if (lane == NULL)
+    {
+        pthread_mutex_unlock(&pool.lock);
+        free(job);
+        return NULL;
+    }
+
+    if (lane->tail == NULL)
+    {
+        lane->head = lane->tail = job;
+        if (!lane->running)
+            ready_push(lane);
+    }
+    else
+    {
+        lane->tail->next = job;
+        lane->tail = job;
+    }
+    pool.pending++;
+    pthread_mutex_unlock(&pool.lock);
+    return job;
+}
+
+bool bitarray_job_poll(bitarray_job_t* const job)
+{
+    pthread_mutex_lock(&pool.lock);
+    const bool done = job->done;
+    pthread_mutex_unlock(&pool.lock);
+    return done;
+}
+
+void bitarray_job_wait(bitarray_job_t* const job)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!job->done)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void bitarray_job_on_complete(bitarray_job_t* const job,
+                              const bitarray_job_callback_t callback,
+                              void* const arg)
+{
+    pthread_mutex_lock(&pool.lock);
+    const bool rotated = job->rotated;
+    if (!rotated)
+    {
+        job->callback = callback;
+        job->arg = arg;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (rotated && callback != NULL)
+        callback(arg);
+}
+
+void bitarray_job_free(bitarray_job_t* const job)
+{
+    if (job == NULL)
+        return;
+    bitarray_job_wait(job);
+    free(job);
+}
+
+/* Start nthreads workers (one per online CPU if 0). Requires pool.lock. */
+static bool pool_start_locked(unsigned nthreads)
+{
+    if (nthreads == 0)
+    {
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+
+    pool.threads = malloc(nthreads * sizeof(pthread_t));
+    if (pool.threads == NULL)
+        return false;
+
+    /* Keep whatever workers did start; one is enough to drain the queue. */
+    pool.nthreads = 0;
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) != 0)
+            break;
+        pool.nthreads++;
+    }
+    if (pool.nthreads == 0)
+    {
+        free(pool.threads);
+        pool.threads = NULL;
+        return false;
+    }
+    pool.running = true;
+    return true;
+}
+
+static void* pool_worker(void* unused)
+{
+    (void)unused;
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.ready_head == NULL && !pool.stopping)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        struct lane* const lane = ready_pop();
+        if (lane == NULL)
+            break;
+
+        bitarray_job_t* const job = lane->head;
+        lane->head = job->next;
+        if (lane->head == NULL)
+            lane->tail = NULL;
+        lane->running = true;
+        pthread_mutex_unlock(&pool.lock);
+
+        bitarray_rotate(job->bitarray, job->bit_offset, job->bit_length, job->shift);
+
+        pthread_mutex_lock(&pool.lock);
+        lane->running = false;
+        if (lane->head != NULL)
+            ready_push(lane);
+        else
+            lane_remove(lane);
+
+        /* Once rotated is set, bitarray_job_on_complete runs callbacks
+           itself, so the one taken here is the last attached. done is
+           published only after it returns, so that a caller that waits on
+           the job may then free whatever the callback uses. */
+        const bitarray_job_callback_t callback = job->callback;
+        void* const arg = job->arg;
+        job->rotated = true;
+        if (callback != NULL)
+        {
+            pthread_mutex_unlock(&pool.lock);
+            callback(arg);
+            pthread_mutex_lock(&pool.lock);
+        }
+        job->done = true;
+        pool.pending--;
+        pthread_cond_broadcast(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static struct lane** lane_bucket(const bitarray_t* const bitarray)
+{
+    return &pool.buckets[((uintptr_t)bitarray >> 4) % LANE_BUCKETS];
+}
+
+/* Find the lane of bitarray, creating an empty one if it has none. Requires
+   pool.lock. */
+static struct lane* lane_get(bitarray_t* const bitarray)
+{
+    struct lane** const bucket = lane_bucket(bitarray);
+    for (struct lane* lane = *bucket; lane != NULL; lane = lane->next_bucket)
+    {
+        if (lane->bitarray == bitarray)
+            return lane;
+    }
+
+    struct lane* const lane = calloc(1, sizeof(struct lane));
+    if (lane == NULL)
+        return NULL;
+    lane->bitarray = bitarray;
+    lane->next_bucket = *bucket;
+    *bucket = lane;
+    return lane;
+}
+
+/* Unlink and free an idle, empty lane. Requires pool.lock. */
+static void lane_remove(struct lane* const lane)
+{
+    struct lane** link = lane_bucket(lane->bitarray);
+    while (*link != lane)
+        link = &(*link)->next_bucket;
+    *link = lane->next_bucket;
+    free(lane);
+}
+
+/* Requires pool.lock. */
+static void ready_push(struct lane* const lane)
+{
+    lane->next_ready = NULL;
+    if (pool.ready_tail == NULL)
+        pool.ready_head = lane;
+    else
+        pool.ready_tail->next_ready = lane;
+    pool.ready_tail = lane;
+    pthread_cond_signal(&pool.work);
+}
+
+/* Requires pool.lock. */
+static struct lane* ready_pop(void)
+{
+    struct lane* const lane = pool.ready_head;
+    if (lane != NULL)
+    {
+        pool.ready_head = lane->next_ready;
+        if (pool.ready_head == NULL)
+            pool.ready_tail = NULL;
+    }
+    return lane;
+}
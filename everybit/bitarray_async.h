@@ -0,0 +1,69 @@
+#ifndef BITARRAY_ASYNC_H
+#define BITARRAY_ASYNC_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "./bitarray.h"
+
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+typedef struct bitarray_job bitarray_job_t; /* Handle on a queued rotation */
+
+/* Called on a worker thread once the rotation behind a job has finished. */
+typedef void (*bitarray_job_callback_t)(void* arg);
+
+/***************************************************************************/
+/* Prototypes                                                              */
+/***************************************************************************/
+
+/* Start the worker pool with nthreads threads; nthreads = 0 picks one per
+   online CPU. Calling this is optional: the first bitarray_rotate_async
+   starts a default pool. Returns false if the pool is already running or no
+   thread could be started.
+*/
+bool bitarray_async_init(const unsigned nthreads);
+
+/* Wait for every queued job to finish, then stop the worker pool. Handles
+   that have not been freed stay valid and report completion.
+*/
+void bitarray_async_shutdown(void);
+
+/* Queue bitarray_rotate(bitarray, bit_offset, bit_length, shift) on the
+   worker pool and return a handle on it, or NULL if the job could not be
+   queued.
+
+   Jobs on different arrays run in parallel; jobs on the same array run one
+   at a time, in the order they were queued. Until its last job completes,
+   the array must not be freed or touched through the synchronous API.
+*/
+bitarray_job_t* bitarray_rotate_async(bitarray_t* const bitarray,
+                                      const size_t bit_offset,
+                                      const size_t bit_length,
+                                      const ssize_t shift);
+
+/* Return whether job has completed, without blocking. A job completes once
+   its rotation has finished and its callback, if any, has returned. */
+bool bitarray_job_poll(bitarray_job_t* const job);
+
+/* Block until job has completed, callback included; after that the
+   callback no longer uses its arg, so the caller may free it. */
+void bitarray_job_wait(bitarray_job_t* const job);
+
+/* Have callback(arg) run on a worker thread once the rotation behind job
+   has finished, before the job counts as completed. If the rotation has
+   already finished, the callback runs right away on the calling thread. A
+   job holds one callback; attaching another replaces it. The callback must
+   not wait on its own job, and the next job queued on the same array may
+   start while it runs.
+*/
+void bitarray_job_on_complete(bitarray_job_t* const job,
+                              const bitarray_job_callback_t callback,
+                              void* const arg);
+
+/* Wait for job to complete, then release its handle. */
+void bitarray_job_free(bitarray_job_t* const job);
+
+#endif // BITARRAY_ASYNC_H
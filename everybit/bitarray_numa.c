@@ -0,0 +1,279 @@
+/* Implements NUMA placement for bit array buffers on top of the raw Linux
+   memory policy system calls, so that no libnuma is needed. Buffers are
+   mapped anonymously, given a policy with mbind(), and left for the page
+   fault handler to place; BITARRAY_NUMA_PARTITION gives each slice a
+   preferred node of its own and faults it in from a thread running on that
+   node. On other systems every policy falls back to calloc.
+ */
+
+#define _GNU_SOURCE
+#include "./bitarray_numa.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/***************************************************************************/
+/* Macros                                                                  */
+/***************************************************************************/
+
+/* Memory policy modes and flags from <linux/mempolicy.h>. */
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MPOL_F_MEMS_ALLOWED (1 << 2)
+
+/* Largest number of nodes a node mask can describe. */
+#define MAX_NODES 1024
+#define NODEMASK_WORDS (MAX_NODES / (8 * sizeof(unsigned long)))
+
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+/* One slice of a BITARRAY_NUMA_PARTITION buffer and the node it belongs
+   on. */
+struct slice {
+    char* base;
+    size_t bytes;
+    int node;
+};
+
+/***************************************************************************/
+/* Prototypes for static functions                                         */
+/***************************************************************************/
+
+#ifdef __linux__
+static bool allowed_nodes(unsigned long* const mask);
+static void* touch_slice(void* arg);
+static void place_slice(const struct slice* const slice);
+static bool partition(char* const buf, const size_t bytes, unsigned nthreads);
+#endif
+
+/***************************************************************************/
+/* Functions                                                               */
+/***************************************************************************/
+
+#ifdef __linux__
+
+void* bitarray_numa_alloc(const size_t bytes,
+                          const bitarray_numa_t policy,
+                          const unsigned nthreads)
+{
+    void* const buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    /* A failed placement leaves the default policy in force, which is still
+       a correct buffer, so errors are ignored. */
+    unsigned long mask[NODEMASK_WORDS];
+    switch (policy)
+    {
+    case BITARRAY_NUMA_LOCAL:
+    {
+        unsigned cpu, node;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < MAX_NODES)
+        {
+            memset(mask, 0, sizeof(mask));
+            mask[node / (8 * sizeof(unsigned long))] |=
+                1UL << (node % (8 * sizeof(unsigned long)));
+            syscall(SYS_mbind, buf, bytes, MPOL_PREFERRED, mask, MAX_NODES, 0);
+        }
+        break;
+    }
+    case BITARRAY_NUMA_INTERLEAVE:
+        if (allowed_nodes(mask))
+            syscall(SYS_mbind, buf, bytes, MPOL_INTERLEAVE, mask, MAX_NODES, 0);
+        break;
+    case BITARRAY_NUMA_PARTITION:
+        partition(buf, bytes, nthreads);
+        break;
+    default:
+        break;
+    }
+    return buf;
+}
+
+void bitarray_numa_free(void* const ptr, const size_t bytes)
+{
+    if (ptr != NULL)
+        munmap(ptr, bytes);
+}
+
+int bitarray_numa_node_count(void)
+{
+    unsigned long mask[NODEMASK_WORDS];
+    if (!allowed_nodes(mask))
+        return 1;
+    int count = 1;
+    for (int node = 0; node < MAX_NODES; ++node)
+    {
+        if (mask[node / (8 * sizeof(unsigned long))] &
+            (1UL << (node % (8 * sizeof(unsigned long)))))
+            count = node + 1;
+    }
+    return count;
+}
+
+bool bitarray_numa_run_on_node(const int node)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* const f = fopen(path, "r");
+    if (f == NULL)
+        /* No sysfs node information: a single-node host runs anywhere. */
+        return node == 0;
+
+    /* The list looks like "0-3,8-11". */
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int lo, hi;
+    char sep;
+    while (fscanf(f, "%d", &lo) == 1)
+    {
+        hi = lo;
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+        {
+            if (fscanf(f, "%d", &hi) != 1)
+                break;
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = '\n';
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &cpus);
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+
+    return CPU_COUNT(&cpus) > 0 &&
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+/* Fill mask with the nodes the process may allocate from. */
+static bool allowed_nodes(unsigned long* const mask)
+{
+    memset(mask, 0, NODEMASK_WORDS * sizeof(unsigned long));
+    return syscall(SYS_get_mempolicy, NULL, mask, MAX_NODES, NULL,
+                   MPOL_F_MEMS_ALLOWED) == 0;
+}
+
+/* Thread body placing one slice: the thread moves to the slice's node
+   first, so that the zeroing is local too. */
+static void* touch_slice(void* arg)
+{
+    const struct slice* const slice = arg;
+    bitarray_numa_run_on_node(slice->node);
+    place_slice(slice);
+    return NULL;
+}
+
+/* Give a slice its node with mbind() and fault it in from the calling
+   thread, wherever that runs: the policy, not the thread, decides where
+   the pages go. */
+static void place_slice(const struct slice* const slice)
+{
+    if (slice->bytes == 0)
+        return;
+    if (slice->node < MAX_NODES)
+    {
+        unsigned long mask[NODEMASK_WORDS];
+        memset(mask, 0, sizeof(mask));
+        mask[slice->node / (8 * sizeof(unsigned long))] |=
+            1UL << (slice->node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, slice->base, slice->bytes, MPOL_PREFERRED, mask, MAX_NODES, 0);
+    }
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < slice->bytes; off += page)
+        slice->base[off] = 0;
+}
+
+/* Split buf into nthreads page-aligned slices and place slice i on node
+   i * nodes / nthreads, so that with one slice per node slice i is on node
+   i. Each slice is given its node as the preferred one with mbind(), so
+   pages spill to other nodes only when it is full, and faulted in from a
+   thread of its own; slices whose thread cannot be started are faulted in
+   by the caller, which is left running where it was. */
+static bool partition(char* const buf, const size_t bytes, unsigned nthreads)
+{
+    if (nthreads == 0)
+    {
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+    const int nodes = bitarray_numa_node_count();
+
+    struct slice* const slices = malloc(nthreads * sizeof(struct slice));
+    pthread_t* const threads = malloc(nthreads * sizeof(pthread_t));
+    bool* const started = calloc(nthreads, sizeof(bool));
+    if (slices == NULL || threads == NULL || started == NULL)
+    {
+        free(slices);
+        free(threads);
+        free(started);
+        return false;
+    }
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t pages = (bytes + page - 1) / page;
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        const size_t first = pages * i / nthreads * page;
+        const size_t last = pages * (i + 1) / nthreads * page;
+        slices[i].base = buf + first;
+        slices[i].bytes = (last < bytes ? last : bytes) - first;
+        slices[i].node = (int)((size_t)nodes * i / nthreads);
+        started[i] = pthread_create(&threads[i], NULL, touch_slice, &slices[i]) == 0;
+    }
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            place_slice(&slices[i]);
+    }
+
+    free(slices);
+    free(threads);
+    free(started);
+    return true;
+}
+
+#else // !__linux__
+
+void* bitarray_numa_alloc(const size_t bytes,
+                          const bitarray_numa_t policy,
+                          const unsigned nthreads)
+{
+    (void)policy;
+    (void)nthreads;
+    return calloc(bytes, 1);
+}
+
+void bitarray_numa_free(void* const ptr, const size_t bytes)
+{
+    (void)bytes;
+    free(ptr);
+}
+
+int bitarray_numa_node_count(void)
+{
+    return 1;
+}
+
+bool bitarray_numa_run_on_node(const int node)
+{
+    return node == 0;
+}
+
+#endif // __linux__
@@ -0,0 +1,37 @@
+#ifndef BITARRAY_NUMA_H
+#define BITARRAY_NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "./bitarray.h"
+
+/***************************************************************************/
+/* Prototypes                                                              */
+/***************************************************************************/
+
+/* Allocate bytes of zeroed memory whose pages are placed according to
+   policy; see bitarray_numa_t. BITARRAY_NUMA_PARTITION first-touches the
+   buffer from nthreads threads. Returns NULL on failure. Placement is best
+   effort: where the kernel offers no NUMA support the memory is still
+   returned, just placed by the default policy.
+*/
+void* bitarray_numa_alloc(const size_t bytes,
+                          const bitarray_numa_t policy,
+                          const unsigned nthreads);
+
+/* Free memory of the given size allocated by bitarray_numa_alloc. */
+void bitarray_numa_free(void* const ptr, const size_t bytes);
+
+/* Get the number of NUMA nodes the process may allocate from; node ids run
+   from 0 to the returned value minus one, possibly with gaps. Returns 1 on
+   a host without NUMA support.
+*/
+int bitarray_numa_node_count(void);
+
+/* Restrict the calling thread to the CPUs of a node. Returns false if the
+   node has no CPUs or the thread could not be moved.
+*/
+bool bitarray_numa_run_on_node(const int node);
+
+#endif // BITARRAY_NUMA_H
@@ -0,0 +1,426 @@
+/* Implements the bit matrix specified in bitmatrix.h on a single bit array
+   holding the rows one after another. Rows are padded to whole words, so
+   the 64 x 64 blocks of the transpose and the row slices a column rotation
+   moves all start at the same bit of a word. The bulk operations work on
+   the words of the array in place, through bitarray_view_words and
+   bitarray_edit_words, so moving a word costs a load and a store rather
+   than a call.
+ */
+
+#include "./bitmatrix.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+/***************************************************************************/
+/* Macros                                                                  */
+/***************************************************************************/
+
+/* Transpose blocks are visited in tiles of TILE_BLOCKS x TILE_BLOCKS. A
+   tile reads one 64-byte line from each of its TILE_ROWS rows and writes
+   as many, 64 KiB in all, which stays in a typical L2. */
+#define TILE_BLOCKS 8
+#define TILE_ROWS (64 * TILE_BLOCKS)
+
+/* A column rotation stages up to BAND_BUF_BYTES of row slices in one
+   piece. */
+#define BAND_BUF_BYTES (4u << 20)
+
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+struct bitmatrix {
+    bitarray_t* bits; /* Row r starts at bit r * stride */
+    size_t rows;
+    size_t cols;
+    size_t stride; /* cols rounded up to a multiple of 64 */
+};
+
+/* The words of a band of columns: nwords words of each row from word first
+   on, of which the band holds the bits under first_mask in the first word
+   and under last_mask in the last one (both masks in a one-word band). */
+struct band {
+    int_t* buf; /* Word 0 of row 0 */
+    size_t row_words;
+    size_t first;
+    size_t nwords;
+    int_t first_mask;
+    int_t last_mask;
+};
+
+/***************************************************************************/
+/* Prototypes for static functions                                         */
+/***************************************************************************/
+
+static inline int_t* band_slice(const struct band* const band, const size_t row);
+static void copy_slice(const struct band* const band,
+                       int_t* const dst,
+                       const int_t* const src);
+static void move_slices(const struct band* const band,
+                        const size_t from,
+                        const size_t to,
+                        const size_t n);
+static void swap_slices(const struct band* const band,
+                        const size_t i,
+                        const size_t j,
+                        const size_t n);
+static void transpose_block(int_t* const block);
+static inline void transpose_round(int_t* const block,
+                                   const unsigned j,
+                                   const int_t mask);
+
+/***************************************************************************/
+/* Functions                                                               */
+/***************************************************************************/
+
+bitmatrix_t* bitmatrix_new(const size_t rows, const size_t cols)
+{
+    bitmatrix_t* const matrix = malloc(sizeof(struct bitmatrix));
+    if (matrix == NULL)
+        return NULL;
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = (cols + 63) / 64 * 64;
+    matrix->bits = bitarray_new(rows * matrix->stride);
+    if (matrix->bits == NULL)
+    {
+        free(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+void bitmatrix_free(bitmatrix_t* const matrix)
+{
+    if (matrix == NULL)
+        return;
+    bitarray_free(matrix->bits);
+    free(matrix);
+}
+
+size_t bitmatrix_rows(const bitmatrix_t* const matrix)
+{
+    return matrix->rows;
+}
+
+size_t bitmatrix_cols(const bitmatrix_t* const matrix)
+{
+    return matrix->cols;
+}
+
+bitarray_t* bitmatrix_bits(bitmatrix_t* const matrix)
+{
+    return matrix->bits;
+}
+
+size_t bitmatrix_stride(const bitmatrix_t* const matrix)
+{
+    return matrix->stride;
+}
+
+bool bitmatrix_get(const bitmatrix_t* const matrix,
+                   const size_t row,
+                   const size_t col)
+{
+    assert(row < matrix->rows && col < matrix->cols);
+    return bitarray_get(matrix->bits, row * matrix->stride + col);
+}
+
+void bitmatrix_set(bitmatrix_t* const matrix,
+                   const size_t row,
+                   const size_t col,
+                   const bool value)
+{
+    assert(row < matrix->rows && col < matrix->cols);
+    bitarray_set(matrix->bits, row * matrix->stride + col, value);
+}
+
+void bitmatrix_get_row(const bitmatrix_t* const matrix,
+                       const size_t row,
+                       int_t* const words)
+{
+    assert(row < matrix->rows);
+    bitarray_get_range(matrix->bits, row * matrix->stride, matrix->cols, words);
+}
+
+void bitmatrix_set_row(bitmatrix_t* const matrix,
+                       const size_t row,
+                       const int_t* const words)
+{
+    assert(row < matrix->rows);
+    bitarray_set_range(matrix->bits, row * matrix->stride, matrix->cols, words);
+}
+
+void bitmatrix_rotate_row(bitmatrix_t* const matrix,
+                          const size_t row,
+                          const ssize_t shift)
+{
+    assert(row < matrix->rows);
+    bitarray_rotate(matrix->bits, row * matrix->stride, matrix->cols, shift);
+}
+
+bool bitmatrix_rotate_cols(bitmatrix_t* const matrix,
+                           const size_t col,
+                           const size_t ncols,
+                           const ssize_t shift)
+{
+    const size_t rows = matrix->rows;
+    assert(col + ncols <= matrix->cols);
+    if (rows == 0 || ncols == 0)
+        return true;
+    const size_t down = shift >= 0 ? (size_t)shift % rows :
+        (rows - (size_t)(-(shift + 1)) % rows - 1) % rows;
+    if (down == 0)
+        return true;
+
+    /* Rotating down by down moves the last b = down slices in front of the
+       first a, as bitarray_rotate does with bits. While the smaller piece
+       is too big to stage, swapping it with its place shrinks the problem
+       (Gries-Mills); then it is staged while the other piece slides past
+       it, every pass going through the rows in order. Transposing 64 x 64
+       blocks of a strip, rotating their rows and transposing back would
+       only move whole words from row to row, so the words are moved as
+       they are. */
+    struct band band;
+    band.row_words = matrix->stride / 64;
+    band.first = col / 64;
+    band.nwords = (col + ncols - 1) / 64 - band.first + 1;
+    band.first_mask = ~(int_t)0 >> (col % 64);
+    band.last_mask = ~(int_t)0 << (63 - (col + ncols - 1) % 64);
+    if (band.nwords == 1)
+    {
+        band.first_mask &= band.last_mask;
+        band.last_mask = band.first_mask;
+    }
+    const size_t stage_rows = BAND_BUF_BYTES / (band.nwords * sizeof(int_t));
+    const size_t small = down < rows - down ? down : rows - down;
+    const size_t staged = small < stage_rows ? small : stage_rows;
+    int_t* const stage = malloc((staged > 0 ? staged : 1) * band.nwords * sizeof(int_t));
+    if (stage == NULL)
+        return false;
+    band.buf = bitarray_edit_words(matrix->bits, 0, rows * band.row_words - 1);
+
+    size_t p = 0;
+    size_t a = rows - down;
+    size_t b = down;
+    while (a != 0 && b != 0)
+    {
+        if (b <= a && b <= stage_rows)
+        {
+            for (size_t r = 0; r < b; ++r)
+                memcpy(&stage[r * band.nwords], band_slice(&band, p + a + r),
+                       band.nwords * sizeof(int_t));
+            move_slices(&band, p, p + b, a);
+            for (size_t r = 0; r < b; ++r)
+                copy_slice(&band, band_slice(&band, p + r), &stage[r * band.nwords]);
+            break;
+        }
+        if (a < b && a <= stage_rows)
+        {
+            for (size_t r = 0; r < a; ++r)
+                memcpy(&stage[r * band.nwords], band_slice(&band, p + r),
+                       band.nwords * sizeof(int_t));
+            move_slices(&band, p + a, p, b);
+            for (size_t r = 0; r < a; ++r)
+                copy_slice(&band, band_slice(&band, p + b + r), &stage[r * band.nwords]);
+            break;
+        }
+        if (a <= b)
+        {
+            swap_slices(&band, p, p + b, a);
+            b -= a;
+        }
+        else
+        {
+            swap_slices(&band, p, p + a, b);
+            p += b;
+            a -= b;
+        }
+    }
+    free(stage);
+    return true;
+}
+
+bitmatrix_t* bitmatrix_transpose(const bitmatrix_t* const matrix)
+{
+    const size_t rows = matrix->rows;
+    const size_t cols = matrix->cols;
+    bitmatrix_t* const result = bitmatrix_new(cols, rows);
+    if (result == NULL)
+        return NULL;
+
+    if (rows == 0 || cols == 0)
+        return result;
+
+    /* A tile is copied into tile block by block, each block's 64 words in
+       a row, transposed there, and copied out again as strips of result.
+       Whole 64-byte lines move between the matrices and the buffer, so
+       rows of a power-of-two stride, which share few cache sets, are each
+       touched once per tile. */
+    const size_t src_row = matrix->stride / 64;
+    const size_t dst_row = result->stride / 64;
+    int_t* const tile = malloc(TILE_BLOCKS * TILE_BLOCKS * 64 * sizeof(int_t));
+    if (tile == NULL)
+    {
+        bitmatrix_free(result);
+        return NULL;
+    }
+
+    /* A clone that still reads some chunks through its source is copied
+       out first, in one call. */
+    int_t* copy = NULL;
+    const int_t* src = bitarray_view_words(matrix->bits, 0, rows * src_row - 1);
+    if (src == NULL)
+    {
+        copy = malloc(rows * src_row * sizeof(int_t));
+        if (copy == NULL)
+        {
+            free(tile);
+            bitmatrix_free(result);
+            return NULL;
+        }
+        bitarray_get_range(matrix->bits, 0, rows * matrix->stride, copy);
+        src = copy;
+    }
+    int_t* const dst = bitarray_edit_words(result->bits, 0, cols * dst_row - 1);
+
+    for (size_t ti = 0; ti < rows; ti += TILE_ROWS)
+    {
+        /* The rows of matrix, and so the columns of result, in the tile,
+           and the words they take up in a row of result. */
+        const size_t nrows = rows - ti < TILE_ROWS ? rows - ti : TILE_ROWS;
+        const size_t ni = (nrows + 63) / 64;
+        for (size_t tj = 0; tj < cols; tj += TILE_ROWS)
+        {
+            const size_t ncols = cols - tj < TILE_ROWS ? cols - tj : TILE_ROWS;
+            const size_t nj = (ncols + 63) / 64;
+
+            /* Block (bi, bj) of the tile is at tile[(bi * TILE_BLOCKS + bj)
+               * 64]. Rows past the end of matrix read as clear, which keeps
+               the padding of result clear. */
+            for (size_t r = 0; r < ni * 64; ++r)
+            {
+                int_t* const blocks = &tile[(r / 64 * TILE_BLOCKS) * 64 + r % 64];
+                if (r < nrows)
+                {
+                    const int_t* const strip = &src[(ti + r) * src_row + tj / 64];
+                    for (size_t bj = 0; bj < nj; ++bj)
+                        blocks[bj * 64] = strip[bj];
+                }
+                else
+                {
+                    for (size_t bj = 0; bj < nj; ++bj)
+                        blocks[bj * 64] = 0;
+                }
+            }
+
+            for (size_t bi = 0; bi < ni; ++bi)
+                for (size_t bj = 0; bj < nj; ++bj)
+                    transpose_block(&tile[(bi * TILE_BLOCKS + bj) * 64]);
+
+            for (size_t c = 0; c < ncols; ++c)
+            {
+                const int_t* const blocks = &tile[(c / 64) * 64 + c % 64];
+                int_t* const strip = &dst[(tj + c) * dst_row + ti / 64];
+                for (size_t bi = 0; bi < ni; ++bi)
+                    strip[bi] = blocks[bi * TILE_BLOCKS * 64];
+            }
+        }
+    }
+    free(copy);
+    free(tile);
+    return result;
+}
+
+/* The first word of the band in a row. */
+static inline int_t* band_slice(const struct band* const band, const size_t row)
+{
+    return band->buf + row * band->row_words + band->first;
+}
+
+/* Copy the band's bits of one row slice to another, leaving the bits of
+   dst outside the band untouched. */
+static void copy_slice(const struct band* const band,
+                       int_t* const dst,
+                       const int_t* const src)
+{
+    const size_t n = band->nwords;
+    dst[0] ^= (dst[0] ^ src[0]) & band->first_mask;
+    for (size_t k = 1; k + 1 < n; ++k)
+        dst[k] = src[k];
+    dst[n - 1] ^= (dst[n - 1] ^ src[n - 1]) & band->last_mask;
+}
+
+/* Move the slices of n rows from row from on to row to on. The rows may
+   overlap: a move to higher rows runs from the last row back, so no row is
+   overwritten before it is read. */
+static void move_slices(const struct band* const band,
+                        const size_t from,
+                        const size_t to,
+                        const size_t n)
+{
+    for (size_t done = 0; done < n; ++done)
+    {
+        const size_t k = to > from ? n - 1 - done : done;
+        copy_slice(band, band_slice(band, to + k), band_slice(band, from + k));
+    }
+}
+
+/* Swap the slices of rows [i, i + n) with those of rows [j, j + n), which
+   must not overlap. */
+static void swap_slices(const struct band* const band,
+                        const size_t i,
+                        const size_t j,
+                        const size_t n)
+{
+    const size_t last = band->nwords - 1;
+    for (size_t r = 0; r < n; ++r)
+    {
+        int_t* const x = band_slice(band, i + r);
+        int_t* const y = band_slice(band, j + r);
+        for (size_t k = 0; k <= last; ++k)
+        {
+            const int_t mask = k == 0 ? band->first_mask :
+                k == last ? band->last_mask : ~(int_t)0;
+            const int_t t = (x[k] ^ y[k]) & mask;
+            x[k] ^= t;
+            y[k] ^= t;
+        }
+    }
+}
+
+/* Transpose a 64 x 64 block of bits in place, word r holding row r with
+   column 0 in its most significant bit. Round j swaps the j x j sub-blocks
+   above the diagonal of each 2j x 2j block with those below it. */
+static void transpose_block(int_t* const block)
+{
+    transpose_round(block, 32, 0x00000000FFFFFFFFULL);
+    transpose_round(block, 16, 0x0000FFFF0000FFFFULL);
+    transpose_round(block, 8, 0x00FF00FF00FF00FFULL);
+    transpose_round(block, 4, 0x0F0F0F0F0F0F0F0FULL);
+    transpose_round(block, 2, 0x3333333333333333ULL);
+    transpose_round(block, 1, 0x5555555555555555ULL);
+}
+
+/* One round of transpose_block. It is inlined with j a constant, so the
+   loop over the j rows of a sub-block unrolls and vectorizes. */
+static inline void transpose_round(int_t* const block,
+                                   const unsigned j,
+                                   const int_t mask)
+{
+    for (unsigned g = 0; g < 64; g += 2 * j)
+    {
+        for (unsigned k = g; k < g + j; ++k)
+        {
+            const int_t t = (block[k] ^ (block[k + j] >> j)) & mask;
+            block[k] ^= t;
+            block[k + j] ^= t << j;
+        }
+    }
+}
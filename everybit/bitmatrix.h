@@ -0,0 +1,102 @@
+#ifndef BITMATRIX_H
+#define BITMATRIX_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "./bitarray.h"
+
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+typedef struct bitmatrix bitmatrix_t; /* A 2D array of bits on a bitarray_t */
+
+/***************************************************************************/
+/* Prototypes                                                              */
+/***************************************************************************/
+
+/* Allocate a matrix of rows x cols bits, all clear, or return NULL if memory
+   runs out. The bits are stored row by row in one bit array; each row is
+   padded to a whole number of 64-bit words so that every row, and every
+   64-column strip of it, starts on a word boundary.
+*/
+bitmatrix_t* bitmatrix_new(const size_t rows, const size_t cols);
+
+/* Free a matrix and the bit array under it. */
+void bitmatrix_free(bitmatrix_t* const matrix);
+
+/* Get the number of rows of a matrix. */
+size_t bitmatrix_rows(const bitmatrix_t* const matrix);
+
+/* Get the number of columns of a matrix. */
+size_t bitmatrix_cols(const bitmatrix_t* const matrix);
+
+/* Get the bit array holding a matrix. Bit (row, col) is bit
+   row * bitmatrix_stride(matrix) + col of it; the padding at the end of
+   each row should be left clear.
+*/
+bitarray_t* bitmatrix_bits(bitmatrix_t* const matrix);
+
+/* Get the number of bits from the start of one row to the next. */
+size_t bitmatrix_stride(const bitmatrix_t* const matrix);
+
+/* Retrieve the bit in the given zero-based row and column. */
+bool bitmatrix_get(const bitmatrix_t* const matrix,
+                   const size_t row,
+                   const size_t col);
+
+/* Set the bit in the given zero-based row and column. */
+void bitmatrix_set(bitmatrix_t* const matrix,
+                   const size_t row,
+                   const size_t col,
+                   const bool value);
+
+/* Copy a row into words, laid out as bitarray_get_range lays out bits.
+   words must hold (bitmatrix_cols(matrix) + 63) / 64 words.
+*/
+void bitmatrix_get_row(const bitmatrix_t* const matrix,
+                       const size_t row,
+                       int_t* const words);
+
+/* Copy words, laid out as bitmatrix_get_row lays them out, into a row. */
+void bitmatrix_set_row(bitmatrix_t* const matrix,
+                       const size_t row,
+                       const int_t* const words);
+
+/* Rotate a row right by shift places, so that bit (row, col) moves to
+   (row, (col + shift) mod cols). shift can be negative. This is
+   bitarray_rotate on the row.
+*/
+void bitmatrix_rotate_row(bitmatrix_t* const matrix,
+                          const size_t row,
+                          const ssize_t shift);
+
+/* Rotate the ncols columns starting at col down by shift places, so that
+   bit (row, c) moves to ((row + shift) mod rows, c). shift can be negative.
+
+   The band's words of each row are moved to their new row as whole
+   words, with the partial words at its edges masked, going through the
+   rows in order: the smaller of the two groups of rows the rotation
+   exchanges is staged in a scratch buffer of up to 4 MiB while the other
+   slides past it (bigger groups are first cut down by swapping blocks of
+   rows). A wide band costs about what rotating the rows it spans does,
+   or less; a narrow one still reads and writes a cache line per row.
+   Returns false, leaving the matrix untouched, if no scratch memory could
+   be had.
+*/
+bool bitmatrix_rotate_cols(bitmatrix_t* const matrix,
+                           const size_t col,
+                           const size_t ncols,
+                           const ssize_t shift);
+
+/* Make a new matrix holding the transpose of matrix, so that bit (row, col)
+   of matrix is bit (col, row) of the result, or return NULL if memory runs
+   out. The matrix is cut into 64 x 64 blocks, each transposed in registers
+   with six rounds of masked swaps. The blocks are visited in 8 x 8 tiles,
+   each copied a 64-byte line per row into a buffer and out again, so that
+   every line of either matrix is touched once.
+*/
+bitmatrix_t* bitmatrix_transpose(const bitmatrix_t* const matrix);
+
+#endif // BITMATRIX_H
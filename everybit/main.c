@@ -24,7 +24,7 @@ int main(int argc, char** argv)
     opterr = 0;
     int selected_test = -1;
 
-    while ((optchar = getopt(argc, argv, "n:t:sml")) != -1)
+    while ((optchar = getopt(argc, argv, "n:t:smlN")) != -1)
     {
         switch (optchar)
         {
@@ -51,6 +51,11 @@ int main(int argc, char** argv)
             timed_rotation(1.0);
             retval = EXIT_SUCCESS;
             goto cleanup;
+        case 'N':
+            /* -N measures per-node bandwidth under each NUMA placement. */
+            numa_bandwidth((size_t)1 << 30);
+            retval = EXIT_SUCCESS;
+            goto cleanup;
         }
     }
 
@@ -59,6 +64,9 @@ int main(int argc, char** argv)
     retval = EXIT_SUCCESS;
 
 cleanup:
+#ifdef BITARRAY_STATS
+    bitarray_stats_dump(stderr);
+#endif
     return retval;
 }
 
@@ -69,6 +77,7 @@ void print_usage(const char* const argv_0)
             "\t -m Run a sample medium (0.1s) rotation operation\n"
             "\t -s Run a sample large (1s) rotation operation\n"
             "\t    (note: the provided -[s/m/l] options only test performance and NOT correctness.)\n"
+            "\t -N Estimate per-node rotation bandwidth under each NUMA placement policy\n"
             "\t -t tests/default\tRun all tests in the testfile tests/default\n"
             "\t -n 1 -t tests/default\tRun test 1 in the testfile tests/default\n",
             argv_0);
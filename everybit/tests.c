@@ -1,13 +1,18 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 
 #include "./bitarray.h"
+#include "./bitarray_async.h"
+#include "./bitarray_numa.h"
+#include "./bitmatrix.h"
 #include "./ktiming.h"
 #include "./tests.h"
 
@@ -27,6 +32,28 @@ void testutil_frmstr(const char* const bitstring);
 void testutil_rotate(const size_t bit_offset,
                      const size_t bit_length,
                      const ssize_t bit_right_shift_amount);
+void testutil_rotate_async(const size_t bit_offset,
+                           const size_t bit_length,
+                           const ssize_t bit_right_shift_amount);
+static void testutil_wait_async(void);
+void testutil_snapshot(void);
+void testutil_rollback(void);
+void testutil_interleave(const size_t bit_offset,
+                         const size_t bit_length,
+                         const size_t ways,
+                         const size_t group);
+void testutil_insert(const size_t bit_index, const size_t n, const bool value);
+void testutil_erase(const size_t bit_index, const size_t n);
+void testutil_matrix(const size_t cols,
+                     const char op,
+                     const size_t a,
+                     const size_t b,
+                     const ssize_t shift);
+void testutil_compare(const size_t a_offset,
+                      const size_t b_offset,
+                      const size_t bit_length,
+                      const char* const func_name,
+                      const int line);
 void testutil_require_valid_input(const size_t bit_offset,
                                   const size_t bit_length,
                                   const ssize_t bit_right_shift_amount,
@@ -38,6 +65,7 @@ static void testutil_expect_internal(const char* const bitstring,
                                      const char* const func_name,
                                      const int line);
 static bool boolfromchar(const char c);
+static void* numa_worker(void* arg);
 char* next_arg_char();
 
 /***************************************************************************/
@@ -47,8 +75,14 @@ char* next_arg_char();
 /* Some global variable make it easier to run individual tests. */
 
 static bitarray_t* test_bitarray = NULL; /* The bit array currently under test. */
+static bitarray_t* test_snapshot = NULL; /* The last snapshot of test_bitarray. */
 static bool test_verbose = false; /* Whether or not test should be verbose. */
 
+/* Asynchronous rotations queued against test_bitarray and not yet waited on. */
+#define TEST_MAX_JOBS 64
+static bitarray_job_t* test_jobs[TEST_MAX_JOBS];
+static int test_njobs = 0;
+
 /***************************************************************************/
 /* Macros                                                                  */
 /***************************************************************************/
@@ -90,6 +124,22 @@ static bool test_verbose = false; /* Whether or not test should be verbose. */
 */
 #define NEXT_ARG_LONG() atol(strtok(NULL, " "))
 
+/***************************************************************************/
+/* Types                                                                   */
+/***************************************************************************/
+
+/* One node's share of the numa_bandwidth test. */
+struct numa_job {
+    bitarray_t* bitarray;
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t shift;
+    int node;
+    int reps;
+    bool pinned; /* Whether the thread could be moved onto its node */
+    double seconds;
+};
+
 /***************************************************************************/
 /* Functions                                                               */
 /***************************************************************************/
@@ -122,6 +172,11 @@ void testutil_frmstr(const char* const bitstring)
     const size_t bitstring_length = strlen(bitstring);
 
     /* Free it if it had not been freed after a previous test. */
+    if (test_snapshot != NULL)
+    {
+        bitarray_free(test_snapshot);
+        test_snapshot = NULL;
+    }
     if (test_bitarray != NULL)
     {
         bitarray_free(test_bitarray);
@@ -166,20 +221,22 @@ static void testutil_expect_internal(const char* bitstring, const char* const fu
     {
         bad = "bitarray size";
     }
-
-    /* Check the content. */
-    for (size_t i = 0; i < bitstring_length; ++i)
+    else
     {
-        if (bitarray_get(test_bitarray, i) != boolfromchar(bitstring[i]))
+        /* Check the content. */
+        for (size_t i = 0; i < bitstring_length; ++i)
         {
-            bad = "bitarray content";
-            break;
+            if (bitarray_get(test_bitarray, i) != boolfromchar(bitstring[i]))
+            {
+                bad = "bitarray content";
+                break;
+            }
         }
     }
 
     /* Obtain a string for the actual bit array. */
     const size_t actual_bitstring_length = bitarray_get_bit_sz(test_bitarray);
-    char* actual_bitstring = calloc(sizeof(char), bitstring_length + 1);
+    char* actual_bitstring = calloc(sizeof(char), actual_bitstring_length + 1);
     for (size_t i = 0; i < actual_bitstring_length; ++i)
     {
         if (bitarray_get(test_bitarray, i))
@@ -219,6 +276,234 @@ void testutil_rotate(const size_t bit_offset,
     }
 }
 
+void testutil_rotate_async(const size_t bit_offset,
+                           const size_t bit_length,
+                           const ssize_t bit_right_shift_amount)
+{
+    assert(test_bitarray != NULL);
+    if (test_njobs == TEST_MAX_JOBS)
+    {
+        testutil_wait_async();
+    }
+    test_jobs[test_njobs] = bitarray_rotate_async(test_bitarray, bit_offset, bit_length, bit_right_shift_amount);
+    assert(test_jobs[test_njobs] != NULL);
+    test_njobs++;
+}
+
+/* Waits for all queued rotations; they must have run in the order queued. */
+static void testutil_wait_async(void)
+{
+    for (int i = 0; i < test_njobs; ++i)
+    {
+        bitarray_job_free(test_jobs[i]);
+        test_jobs[i] = NULL;
+    }
+    test_njobs = 0;
+    if (test_verbose && test_bitarray != NULL)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " async wait\n");
+    }
+}
+
+void testutil_snapshot(void)
+{
+    assert(test_bitarray != NULL);
+    if (test_snapshot != NULL)
+    {
+        bitarray_free(test_snapshot);
+    }
+    test_snapshot = bitarray_snapshot(test_bitarray);
+    assert(test_snapshot != NULL);
+}
+
+/* Replaces the bit array under test with a copy of the last snapshot. */
+void testutil_rollback(void)
+{
+    assert(test_snapshot != NULL);
+    bitarray_free(test_bitarray);
+    test_bitarray = bitarray_clone(test_snapshot);
+    assert(test_bitarray != NULL);
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " rollback\n");
+    }
+}
+
+/* Interleaves ways equal lanes of a subarray through a permutation plan,
+   group bits at a time: bit r of group k of lane j moves to position
+   (k * ways + j) * group + r. */
+void testutil_interleave(const size_t bit_offset,
+                         const size_t bit_length,
+                         const size_t ways,
+                         const size_t group)
+{
+    assert(test_bitarray != NULL);
+    assert(ways > 0 && group > 0 && bit_length % (ways * group) == 0);
+    const size_t lane = bit_length / ways;
+    size_t* const perm = malloc(bit_length * sizeof(size_t));
+    assert(perm != NULL);
+    for (size_t i = 0; i < bit_length; ++i)
+    {
+        perm[i] = ((i % lane) / group * ways + i / lane) * group + i % group;
+    }
+    bitarray_plan_t* const plan = bitarray_plan_new(perm, bit_length);
+    assert(plan != NULL);
+    const bool permuted = bitarray_permute(test_bitarray, bit_offset, plan);
+    assert(permuted);
+    (void)permuted;
+    bitarray_plan_free(plan);
+    free(perm);
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " interleave off=%zu, len=%zu, ways=%zu, group=%zu\n",
+                bit_offset, bit_length, ways, group);
+    }
+}
+
+void testutil_insert(const size_t bit_index, const size_t n, const bool value)
+{
+    assert(test_bitarray != NULL);
+    const bool inserted = bitarray_insert_bits(test_bitarray, bit_index, n, value);
+    assert(inserted);
+    (void)inserted;
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " insert idx=%zu, n=%zu, val=%d\n", bit_index, n, value ? 1 : 0);
+    }
+}
+
+void testutil_erase(const size_t bit_index, const size_t n)
+{
+    assert(test_bitarray != NULL);
+    bitarray_erase_bits(test_bitarray, bit_index, n);
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " erase idx=%zu, n=%zu\n", bit_index, n);
+    }
+}
+
+/* Views the bit array under test as a matrix of cols columns, filled row
+   by row, applies op to it and flattens the result back into the array:
+   't' transposes the matrix, 'r' rotates row a right by shift, and 'c'
+   rotates the b columns starting at column a down by shift. */
+void testutil_matrix(const size_t cols,
+                     const char op,
+                     const size_t a,
+                     const size_t b,
+                     const ssize_t shift)
+{
+    assert(test_bitarray != NULL);
+    const size_t bit_sz = bitarray_get_bit_sz(test_bitarray);
+    const size_t rows = bit_sz / cols;
+    bitmatrix_t* matrix = bitmatrix_new(rows, cols);
+    int_t* const words = malloc(((cols > rows ? cols : rows) + 63) / 64 * sizeof(int_t));
+    assert(matrix != NULL && words != NULL);
+    for (size_t r = 0; r < rows; ++r)
+    {
+        bitarray_get_range(test_bitarray, r * cols, cols, words);
+        bitmatrix_set_row(matrix, r, words);
+    }
+
+    switch (op)
+    {
+    case 't':
+        {
+            bitmatrix_t* const transposed = bitmatrix_transpose(matrix);
+            assert(transposed != NULL);
+            bitmatrix_free(matrix);
+            matrix = transposed;
+        }
+        break;
+    case 'r':
+        bitmatrix_rotate_row(matrix, a, shift);
+        break;
+    case 'c':
+        {
+            const bool rotated = bitmatrix_rotate_cols(matrix, a, b, shift);
+            assert(rotated);
+            (void)rotated;
+        }
+        break;
+    default:
+        assert(false);
+    }
+
+    const size_t out_cols = bitmatrix_cols(matrix);
+    for (size_t r = 0; r < bitmatrix_rows(matrix); ++r)
+    {
+        bitmatrix_get_row(matrix, r, words);
+        bitarray_set_range(test_bitarray, r * out_cols, out_cols, words);
+    }
+    bitmatrix_free(matrix);
+    free(words);
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " matrix cols=%zu, op=%c, a=%zu, b=%zu, amnt=%zd\n",
+                cols, op, a, b, shift);
+    }
+}
+
+/* Checks bitarray_hamming, bitarray_compare_range and bitarray_hash_range
+   on two ranges of the bit array under test against a bit-by-bit scan. */
+void testutil_compare(const size_t a_offset,
+                      const size_t b_offset,
+                      const size_t bit_length,
+                      const char* const func_name,
+                      const int line)
+{
+    assert(test_bitarray != NULL);
+    size_t distance = 0;
+    int order = 0;
+    for (size_t i = 0; i < bit_length; ++i)
+    {
+        const bool a = bitarray_get(test_bitarray, a_offset + i);
+        const bool b = bitarray_get(test_bitarray, b_offset + i);
+        if (a != b)
+        {
+            if (distance++ == 0)
+            {
+                order = a ? 1 : -1;
+            }
+        }
+    }
+
+    const size_t hamming = bitarray_hamming(test_bitarray, a_offset,
+                                            test_bitarray, b_offset, bit_length);
+    const int compare = bitarray_compare_range(test_bitarray, a_offset,
+                                               test_bitarray, b_offset, bit_length);
+    const bool same_hash = bitarray_hash_range(test_bitarray, a_offset, bit_length) ==
+        bitarray_hash_range(test_bitarray, b_offset, bit_length);
+    if (test_verbose)
+    {
+        bitarray_fprint(stdout, test_bitarray);
+        fprintf(stdout, " compare a=%zu, b=%zu, len=%zu\n", a_offset, b_offset, bit_length);
+    }
+
+    if (hamming != distance)
+    {
+        TEST_FAIL_WITH_NAME(func_name, line, " Incorrect hamming distance %zu, expected %zu", hamming, distance);
+    }
+    else if ((compare > 0) - (compare < 0) != order)
+    {
+        TEST_FAIL_WITH_NAME(func_name, line, " Incorrect comparison %d, expected %d", compare, order);
+    }
+    else if (same_hash != (distance == 0))
+    {
+        TEST_FAIL_WITH_NAME(func_name, line, " Hashes %s for %s ranges", same_hash ? "equal" : "differ",
+                            distance == 0 ? "equal" : "different");
+    }
+    else
+    {
+        TEST_PASS_WITH_NAME(func_name, line);
+    }
+}
+
 void testutil_require_valid_input(const size_t bit_offset,
                                   const size_t bit_length,
                                   const ssize_t bit_right_shift_amount,
@@ -246,8 +531,8 @@ int timed_rotation(const double time_limit_seconds)
     int tier_num = 0;
 
     /* Output format strings */
-    char header[50];
-    sprintf(header, "%-4s %-15s %-15s %-10s\n", "TIER", "SIZE(B)", "#SHIFTS", "TIME(s)");
+    char header[64];
+    sprintf(header, "%-4s %-15s %-15s %-10s %-10s\n", "TIER", "SIZE(B)", "#SHIFTS", "TIME(s)", "DRAM(B/B)");
     printf("%s", header);
 
     /* Continue until the rotation exceeds time_limit_seconds. */
@@ -271,14 +556,18 @@ int timed_rotation(const double time_limit_seconds)
         const clockmark_t end_time = ktiming_getmark();
         double diff_seconds = ktiming_diff_usec(&start_time, &end_time) / 1000000000.0; 
 
+        /* Estimated DRAM traffic per byte of the rotated range. */
+        double dram_ratio = bit_length < 8 ? 0.0 :
+            bitarray_rotate_dram_bytes(bit_length, bit_right_shift_amount) / (double)(bit_length / 8);
+
         if (diff_seconds < time_limit_seconds)
         {
-            printf("%-4d %-15lu %-15lu %-.6f\n", tier_num, bit_length / 8, bit_right_shift_amount, diff_seconds);
+            printf("%-4d %-15lu %-15lu %-10.6f %-.2f\n", tier_num, bit_length / 8, bit_right_shift_amount, diff_seconds, dram_ratio);
             tier_num++;
         }
         else
         {
-            printf("%-4d %-15lu %-15lu %-.6f exceeded %.2fs cutoff\n", tier_num, bit_length / 8, bit_right_shift_amount, diff_seconds, time_limit_seconds);
+            printf("%-4d %-15lu %-15lu %-10.6f %-10.2f exceeded %.2fs cutoff\n", tier_num, bit_length / 8, bit_right_shift_amount, diff_seconds, dram_ratio, time_limit_seconds);
             /* Return the last tier that was successful. */
             return tier_num - 1;
         }
@@ -287,6 +576,76 @@ int timed_rotation(const double time_limit_seconds)
     return tier_num - 1;
 }
 
+static void* numa_worker(void* arg)
+{
+    struct numa_job* const job = arg;
+    job->pinned = bitarray_numa_run_on_node(job->node);
+
+    /* The process CPU clock behind ktiming would add up every worker, so
+       each one reads the wall clock instead. */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < job->reps; ++i)
+    {
+        bitarray_rotate(job->bitarray, job->bit_offset, job->bit_length, job->shift);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    return NULL;
+}
+
+void numa_bandwidth(const size_t bit_sz)
+{
+    static const char* const names[] = {"default", "local", "interleave", "partition"};
+    const bitarray_numa_t policies[] = {BITARRAY_NUMA_DEFAULT, BITARRAY_NUMA_LOCAL,
+                                        BITARRAY_NUMA_INTERLEAVE, BITARRAY_NUMA_PARTITION};
+    const int nodes = bitarray_numa_node_count();
+    struct numa_job* const jobs = calloc(nodes, sizeof(struct numa_job));
+    pthread_t* const threads = calloc(nodes, sizeof(pthread_t));
+    assert(jobs != NULL && threads != NULL);
+
+    printf("%-11s %-5s %s\n", "POLICY", "NODE", "EST(GB/s)");
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p)
+    {
+        bitarray_t* const bitarray = bitarray_new_numa(bit_sz, policies[p], nodes);
+        assert(bitarray != NULL);
+
+        /* Filling from this thread is what places default pages on one node;
+           the other policies have already placed theirs. */
+        srand(6172);
+        bitarray_randfill(bitarray);
+
+        /* Slices start on word boundaries so that no two workers write the
+           same word. */
+        for (int n = 0; n < nodes; ++n)
+        {
+            const size_t first = bit_sz / 64 * n / nodes * 64;
+            const size_t last = n + 1 < nodes ? bit_sz / 64 * (n + 1) / nodes * 64 : bit_sz;
+            jobs[n].bitarray   = bitarray;
+            jobs[n].bit_offset = first;
+            jobs[n].bit_length = last - first;
+            jobs[n].shift      = (last - first) / 3;
+            jobs[n].node       = n;
+            jobs[n].reps       = 3;
+            const int err = pthread_create(&threads[n], NULL, numa_worker, &jobs[n]);
+            assert(err == 0);
+            (void)err;
+        }
+        for (int n = 0; n < nodes; ++n)
+        {
+            pthread_join(threads[n], NULL);
+            /* The bytes are estimated, as for the DRAM(B/B) column of the
+               performance test, not counted. */
+            const double bytes = (double)bitarray_rotate_dram_bytes(jobs[n].bit_length, jobs[n].shift) * jobs[n].reps;
+            printf("%-11s %-5d %.2f%s\n", names[p], n, bytes / jobs[n].seconds / 1e9,
+                   jobs[n].pinned ? "" : " (not pinned)");
+        }
+        bitarray_free(bitarray);
+    }
+    free(jobs);
+    free(threads);
+}
+
 static bool boolfromchar(const char c)
 {
     assert(c == '0' || c == '1');
@@ -323,6 +682,13 @@ void parse_and_run_tests(const char* filename, int selected_test)
     {
         line++;
         char* token = strtok(buf, " ");
+
+        /* Anything but another queued rotation first waits for the queue. */
+        if (token[0] != 'a' && test_njobs > 0)
+        {
+            testutil_wait_async();
+        }
+
         switch (token[0])
         {
         case '\n':
@@ -367,10 +733,151 @@ void parse_and_run_tests(const char* filename, int selected_test)
                 testutil_rotate(offset, length, amount);
             }
             break;
+        case 'p':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t offset = (size_t) NEXT_ARG_LONG();
+                size_t length = (size_t) NEXT_ARG_LONG();
+                size_t ways   = (size_t) NEXT_ARG_LONG();
+                char* group   = strtok(NULL, " ");
+                size_t bits   = group != NULL ? (size_t) atol(group) : 1;
+                testutil_require_valid_input(offset, length, 0, filename, line);
+                if (ways == 0 || bits == 0 || length % (ways * bits) != 0)
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - length is not a multiple of lanes times group");
+                    break;
+                }
+                testutil_interleave(offset, length, ways, bits);
+            }
+            break;
+        case 'i':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t index = (size_t) NEXT_ARG_LONG();
+                size_t n     = (size_t) NEXT_ARG_LONG();
+                bool value   = NEXT_ARG_LONG() != 0;
+                if (index > bitarray_get_bit_sz(test_bitarray))
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - index > bitarray_length");
+                    break;
+                }
+                testutil_insert(index, n, value);
+            }
+            break;
+        case 'd':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t index = (size_t) NEXT_ARG_LONG();
+                size_t n     = (size_t) NEXT_ARG_LONG();
+                if (index + n > bitarray_get_bit_sz(test_bitarray))
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - index + n > bitarray_length");
+                    break;
+                }
+                testutil_erase(index, n);
+            }
+            break;
+        case 'c':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t a_offset = (size_t) NEXT_ARG_LONG();
+                size_t b_offset = (size_t) NEXT_ARG_LONG();
+                size_t length   = (size_t) NEXT_ARG_LONG();
+                size_t bit_sz   = bitarray_get_bit_sz(test_bitarray);
+                if (a_offset + length > bit_sz || b_offset + length > bit_sz)
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - offset + length > bitarray_length");
+                    break;
+                }
+                testutil_compare(a_offset, b_offset, length, filename, line);
+            }
+            break;
+        case 'm':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t cols   = (size_t) NEXT_ARG_LONG();
+                char op       = next_arg_char()[0];
+                size_t a      = 0;
+                size_t b      = 0;
+                ssize_t shift = 0;
+                size_t bit_sz = bitarray_get_bit_sz(test_bitarray);
+                if (op == 'r')
+                {
+                    a = (size_t) NEXT_ARG_LONG();
+                    shift = (ssize_t) NEXT_ARG_LONG();
+                }
+                else if (op == 'c')
+                {
+                    a = (size_t) NEXT_ARG_LONG();
+                    b = (size_t) NEXT_ARG_LONG();
+                    shift = (ssize_t) NEXT_ARG_LONG();
+                }
+                if (cols == 0 || bit_sz % cols != 0 || (op != 't' && op != 'r' && op != 'c'))
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - bad matrix shape or operation");
+                    break;
+                }
+                if ((op == 'r' && a >= bit_sz / cols) || (op == 'c' && a + b > cols))
+                {
+                    TEST_FAIL_WITH_NAME(filename, line, " TEST SUITE ERROR - row or columns outside the matrix");
+                    break;
+                }
+                testutil_matrix(cols, op, a, b, shift);
+            }
+            break;
+        case 's':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            testutil_snapshot();
+            break;
+        case 'u':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            testutil_rollback();
+            break;
+        case 'a':
+            if (!ready_to_run)
+            {
+                continue;
+            }
+            {
+                size_t offset  = (size_t)  NEXT_ARG_LONG();
+                size_t length  = (size_t)  NEXT_ARG_LONG();
+                ssize_t amount = (ssize_t) NEXT_ARG_LONG();
+                testutil_require_valid_input(offset, length, amount, filename, line);
+                testutil_rotate_async(offset, length, amount);
+            }
+            break;
         default:
             fprintf(stderr, "Done testing file %s.\n", buf);
         }
     }
     free(buf);
+    testutil_wait_async();
+    if (test_snapshot != NULL)
+    {
+        bitarray_free(test_snapshot);
+        test_snapshot = NULL;
+    }
+    bitarray_async_shutdown();
     fprintf(stderr, "Done testing file %s.\n", filename);
 }
@@ -17,6 +17,14 @@
 */
 int timed_rotation(const double time_limit_seconds);
 
+/* Allocates a bit_sz-bit array under each NUMA placement policy, then has
+   one thread per node rotate that node's slice of it concurrently, and
+   prints each node's estimated DRAM bandwidth: the bytes
+   bitarray_rotate_dram_bytes estimates its rotations moved, divided by
+   the time they took.
+*/
+void numa_bandwidth(const size_t bit_sz);
+
 /* Runs testsuite specified in a given file.
  */
 void parse_and_run_tests(const char* filename, int selected_test);